@@ -0,0 +1,190 @@
+/* Copyright (c) 2016  Fabrice Triboix
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Multi-threaded benchmark
+ *
+ * Each thread keeps a working set of live blocks and repeatedly frees a
+ * random one and allocates a new one in its place. Run it with a varying
+ * number of threads to see how flloc scales, for example:
+ *
+ *     $ for t in 1 2 4 8; do FLLOC_CONFIG="GUARD=16" ./bench $t; done
+ *
+ * With `-l`, the latency of each `malloc()` and `free()` call is measured and a
+ * histogram is printed at the end. Use `-w` to set the number of live blocks
+ * per thread; a large working set makes flloc grow its tables during the run.
+ */
+
+#include "flloc.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_WORKING_SET 1024
+#define DEFAULT_ITERATIONS 1000000
+#define MAX_THREADS 256
+
+/** Number of histogram buckets; bucket `i` counts latencies < 2^i ns */
+#define HISTO_BUCKETS 32
+
+static long gIterations = DEFAULT_ITERATIONS;
+static long gWorkingSet = DEFAULT_WORKING_SET;
+static int gLatency = 0;
+
+/** Latency histograms, one per thread */
+static uint64_t gHisto[MAX_THREADS][HISTO_BUCKETS];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void record(uint64_t* histo, uint64_t ns)
+{
+    int i = 0;
+    while ((i < (HISTO_BUCKETS - 1)) && (ns >= (1ULL << i))) {
+        i++;
+    }
+    histo[i]++;
+}
+
+static void* worker(void* arg)
+{
+    int index = (int)(uintptr_t)arg;
+    uint64_t* histo = gHisto[index];
+    uint32_t seed = index + 1;
+    void** blocks = malloc(gWorkingSet * sizeof(*blocks));
+    if (NULL == blocks) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    long i;
+    for (i = 0; i < gWorkingSet; i++) {
+        blocks[i] = malloc(16 + (i % 256));
+    }
+    long n;
+    for (n = 0; n < gIterations; n++) {
+        seed = (seed * 1103515245) + 12345;
+        long slot = (seed >> 8) % gWorkingSet;
+        size_t size = 16 + ((seed >> 16) % 256);
+        if (gLatency) {
+            uint64_t t0 = nowNs();
+            free(blocks[slot]);
+            uint64_t t1 = nowNs();
+            blocks[slot] = malloc(size);
+            uint64_t t2 = nowNs();
+            record(histo, t1 - t0);
+            record(histo, t2 - t1);
+        } else {
+            free(blocks[slot]);
+            blocks[slot] = malloc(size);
+        }
+    }
+    for (i = 0; i < gWorkingSet; i++) {
+        free(blocks[i]);
+    }
+    free(blocks);
+    return NULL;
+}
+
+static void printHistogram(int nthreads)
+{
+    uint64_t histo[HISTO_BUCKETS] = { 0 };
+    uint64_t total = 0;
+    int i;
+    int t;
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        for (t = 0; t < nthreads; t++) {
+            histo[i] += gHisto[t][i];
+        }
+        total += histo[i];
+    }
+    printf("Latency of malloc()/free():\n");
+    uint64_t cumul = 0;
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        if (0 == histo[i]) {
+            continue;
+        }
+        cumul += histo[i];
+        printf("  < %10llu ns: %10llu (%7.3f%%, cumulative %7.3f%%)\n",
+                1ULL << i, (unsigned long long)histo[i],
+                (100.0 * histo[i]) / total, (100.0 * cumul) / total);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "lw:")) != -1) {
+        switch (opt) {
+        case 'l' :
+            gLatency = 1;
+            break;
+        case 'w' :
+            gWorkingSet = atol(optarg);
+            break;
+        default :
+            gWorkingSet = 0;
+            break;
+        }
+    }
+    int nthreads = 1;
+    if (optind < argc) {
+        nthreads = atoi(argv[optind]);
+    }
+    if ((optind + 1) < argc) {
+        gIterations = atol(argv[optind + 1]);
+    }
+    if ((nthreads < 1) || (nthreads > MAX_THREADS) || (gIterations < 1)
+            || (gWorkingSet < 1)) {
+        fprintf(stderr, "Usage: %s [-l] [-w WORKING_SET] "
+                "[THREADS [ITERATIONS]]\n", argv[0]);
+        exit(1);
+    }
+
+    pthread_t threads[MAX_THREADS];
+    double start = now();
+    int i;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker,
+                    (void*)(uintptr_t)i) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    double ops = 2.0 * nthreads * gIterations;
+    printf("%d thread(s): %.3f s, %.2f Mops/s\n",
+            nthreads, elapsed, ops / elapsed / 1e6);
+    if (gLatency) {
+        printHistogram(nthreads);
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+/* Copyright (c) 2016  Fabrice Triboix
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replacements for the global C++ `operator new` and `operator delete`
+ *
+ * These are linked into a C++ program along with the rest of `libflloc.a`, so
+ * all blocks allocated by `new` are tracked, whether the code includes
+ * `flloc.h` or not. Blocks are identified by the return address of the
+ * operator. The kind of each block is recorded, so freeing a block with the
+ * wrong function (e.g. `delete` on a block allocated with `new[]`, or `free()`
+ * on a block allocated with `new`) is reported.
+ */
+
+#define FLLOC_DISABLED
+#include "flloc.h"
+#include <new>
+
+
+/*-------------------+
+ | Private functions |
+ +-------------------*/
+
+
+namespace {
+
+
+/** Allocate memory as `operator new` does: call the new handler until the
+ * allocation succeeds, or throw `std::bad_alloc` if there is no handler
+ */
+void* allocate(std::size_t size, std::size_t align, int kind, void* caller)
+{
+    for (;;) {
+        void* ptr = FllocNew(size, align, kind, NULL, 0, caller);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (NULL == handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+
+/** Same as `allocate()`, but return NULL rather than throwing */
+void* allocateNoThrow(std::size_t size, std::size_t align, int kind,
+        void* caller) noexcept
+{
+    try {
+        return allocate(size, align, kind, caller);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+
+} // namespace
+
+
+
+/*-----------------------+
+ | Replacement operators |
+ +-----------------------*/
+
+
+void* operator new(std::size_t size)
+{
+    return allocate(size, 0, FLLOC_KIND_NEW, __builtin_return_address(0));
+}
+
+
+void* operator new[](std::size_t size)
+{
+    return allocate(size, 0, FLLOC_KIND_NEW_ARRAY,
+            __builtin_return_address(0));
+}
+
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocateNoThrow(size, 0, FLLOC_KIND_NEW,
+            __builtin_return_address(0));
+}
+
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocateNoThrow(size, 0, FLLOC_KIND_NEW_ARRAY,
+            __builtin_return_address(0));
+}
+
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    return allocate(size, static_cast<std::size_t>(align), FLLOC_KIND_NEW,
+            __builtin_return_address(0));
+}
+
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+    return allocate(size, static_cast<std::size_t>(align),
+            FLLOC_KIND_NEW_ARRAY, __builtin_return_address(0));
+}
+
+
+void* operator new(std::size_t size, std::align_val_t align,
+        const std::nothrow_t&) noexcept
+{
+    return allocateNoThrow(size, static_cast<std::size_t>(align),
+            FLLOC_KIND_NEW, __builtin_return_address(0));
+}
+
+
+void* operator new[](std::size_t size, std::align_val_t align,
+        const std::nothrow_t&) noexcept
+{
+    return allocateNoThrow(size, static_cast<std::size_t>(align),
+            FLLOC_KIND_NEW_ARRAY, __builtin_return_address(0));
+}
+
+
+void operator delete(void* ptr) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
+
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
+
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+    FllocDelete(ptr, size, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+    FllocDelete(ptr, size, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
+
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
+
+
+void operator delete(void* ptr, std::align_val_t,
+        const std::nothrow_t&) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr, std::align_val_t,
+        const std::nothrow_t&) noexcept
+{
+    FllocDelete(ptr, 0, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
+
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+    FllocDelete(ptr, size, FLLOC_KIND_NEW, NULL, 0);
+}
+
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+    FllocDelete(ptr, size, FLLOC_KIND_NEW_ARRAY, NULL, 0);
+}
@@ -14,12 +14,28 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // for mremap()
 #define FLLOC_DISABLED
 #include "flloc.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#ifdef FLLOC_PRELOAD
+#include <dlfcn.h>
+#endif
 
 
 
@@ -32,33 +48,367 @@
 #define FLLOC_FILL 0xa5
 
 
-/** Number of records in hash table; must be 64K */
-#define REC_COUNT (64* 1024)
+/** Fill pattern for guard blocks, repeated over a 64-bit word */
+#define FLLOC_FILL64 0xa5a5a5a5a5a5a5a5ULL
 
 
-/** A record of an allocated memory area */
+/** Maximum number of shards; must be a power of 2 not greater than 64K */
+#define MAX_SHARDS 1024
+
+
+/** Default number of shards */
+#define DEFAULT_SHARDS 64
+
+
+/** Initial number of slots in the hash table of a shard; must be a power of 2 */
+#define TABLE_INITIAL_SLOTS 256
+
+
+/** Number of old slots migrated on each insertion or removal while growing
+ *
+ * This must be at least 4, so migration completes before the new table (twice
+ * as large) fills up.
+ */
+#define MIGRATE_STEP 16
+
+
+/** Number of blocks the scrubbing thread checks each time it locks a shard */
+#define SCRUB_BATCH 256
+
+
+/** Number of addresses printed for each site in grouped leak reports */
+#define REPORT_SAMPLES 4
+
+
+/** Maximum number of threads scanning for memory leaks at exit */
+#define MAX_SCAN_THREADS 64
+
+
+/** Number of lock-free table slots in one unit of work of the leak scan */
+#define SCAN_CHUNK (64 * 1024)
+
+
+/** Number of events in the trace ring buffer of each thread; must be a power
+ * of 2
+ */
+#define TRACE_RING_EVENTS (32 * 1024)
+
+
+/** How long the trace writer sleeps when there is nothing to write, in ns */
+#define TRACE_PERIOD_NS 1000000
+
+
+/** Record flag: a corruption has already been reported for this block */
+#define FLAG_REPORTED 0x1
+
+
+/** Record flag: the block has been mapped with a protected page next to it */
+#define FLAG_PAGEGUARD 0x2
+
+
+/** Record flag: the block has its own mapping, obtained with `mmap()` */
+#define FLAG_MAPPED 0x4
+
+
+/** Record flags: how the block has been allocated, as a `FLLOC_KIND_xxx` */
+#define FLAG_KIND_SHIFT 3
+#define FLAG_KIND_MASK (0x3 << FLAG_KIND_SHIFT)
+
+
+/** Magic number identifying a block header */
+#define HEADER_MAGIC 0x466c6c6f63486472ULL
+
+
+/** A record of an allocated memory area
+ *
+ * Records are identified by `ptr`, the pointer returned to the user. Free
+ * records are linked through `nextFree` instead.
+ *
+ * This is all the hash tables need; header mode wraps it into a `HeaderRecord`.
+ */
 struct Record {
-    struct Record* next; // single linked list
-    void*          real;
+    union {
+        void*          ptr;      // user pointer
+        struct Record* nextFree; // single linked list of free records
+    };
+    void*          real; // as returned by the underlying allocator
     size_t         size;
-    const char*    file;
-    int            line;
+    size_t         mapSize; // size of the mapping, if FLAG_PAGEGUARD/MAPPED
+    uint32_t       site;    // where the block has been allocated from
+    uint32_t       stack;   // call stack when allocated; 0 if unknown
+    uint32_t       flags;   // combination of FLAG_xxx
 };
 typedef struct Record Record;
 
 
+/** A record in header mode
+ *
+ * It lives in the memory area itself, just in front of the front guard (i.e.
+ * at `ptr - gFrontSize_B`), and is linked into a double linked list; `magic`
+ * and `checksum` are used to validate pointers being freed.
+ */
+struct HeaderRecord {
+    Record               rec; // must come first
+    struct HeaderRecord* next;
+    struct HeaderRecord* prev;
+    uint64_t             magic;
+    uint64_t             checksum;
+};
+typedef struct HeaderRecord HeaderRecord;
+
+
+/** Size reserved for a record at the start of a block in header mode
+ *
+ * This is rounded up to 16 bytes to preserve the alignment of the user block.
+ */
+#define HEADER_SIZE ((sizeof(HeaderRecord) + 15) & ~((size_t)15))
+
+
+/** Size of the tag in front of the blocks which are not sampled
+ *
+ * This is 16 bytes to preserve the alignment of the user block.
+ */
+#define SAMPLE_TAG_SIZE 16
+
+
+/** Alignment of the blocks returned by the C library, and the minimum alignment
+ * of the user blocks
+ */
+#define NATURAL_ALIGN _Alignof(max_align_t)
+
+
+/** Marks a block which is not sampled; it is xor'ed with the user pointer */
+#define SAMPLE_MAGIC 0x8badf00dfee1deadULL
+
+
+/** Maximum depth of the call stacks recorded when `STACK` is set */
+#define MAX_STACK_DEPTH 32
+
+
+/** Maximum number of frames of flloc's own wrappers skipped in a call stack */
+#define STACK_MAX_SKIP 4
+
+
+/** Maximum number of distinct call stacks; must be a power of 2 */
+#define MAX_STACKS (1024 * 1024)
+
+
+/** Size of the arena serving allocations made while looking up the functions
+ * of the C library, in preload mode
+ */
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+
+/** Maximum number of allocation sites; must be a power of 2 */
+#define MAX_SITES (64 * 1024)
+
+
+/** An allocation site, i.e. a place in the source code where memory is
+ * allocated
+ *
+ * Sites are interned: there is only one for each `file`, `line` and `caller`,
+ * so records just hold its index in `gSites`. Sites are never removed. The
+ * counters are updated with relaxed atomic operations; they are only
+ * statistics.
+ */
+struct Site {
+    const char*      file;
+    int              line;
+    void*            caller;     // return address, if `file` is not known
+    _Atomic uint64_t liveCount;  // number of blocks currently allocated
+    _Atomic uint64_t liveBytes;  // number of bytes currently allocated
+    _Atomic uint64_t totalCount; // number of blocks ever allocated
+    _Atomic uint64_t peakBytes;  // maximum value of `liveBytes`
+} __attribute__ (( aligned(64) ));
+typedef struct Site Site;
+
+
+/** Memory leaks from one allocation site, for grouped leak reports */
+struct LeakSite {
+    uint32_t site;
+    uint32_t stack;                   // call stack of the first leaked block
+    uint64_t count;                   // number of leaked blocks
+    uint64_t bytes;                   // total size of leaked blocks
+    double   estBlocks;               // estimates of the above, taking
+    double   estBytes;                // sampling into account
+    void*    samples[REPORT_SAMPLES]; // addresses of the first leaked blocks
+};
+typedef struct LeakSite LeakSite;
+
+
+/** State of one thread scanning for memory leaks at exit
+ *
+ * The units of work are the chunks of `SCAN_CHUNK` slots of the lock-free
+ * table, followed by the shards. Threads take them in turn from `next`.
+ */
+struct Scanner {
+    atomic_size_t* next;  // next unit of work, shared between all scanners
+    size_t         count; // number of units of work
+    LeakSite*      leaks; // leaks found by this scanner; may be NULL
+};
+typedef struct Scanner Scanner;
+
+
+/** A slot of a hash table; `key` is NULL if the slot is empty */
+struct Slot {
+    void*   key;
+    Record* rec;
+};
+typedef struct Slot Slot;
+
+
+/** A shard of the hash table of memory allocation records
+ *
+ * Each shard has its own lock and its own open-addressed hash table, using
+ * Robin Hood hashing with linear probing. The table doubles in size when it is
+ * 7/8 full. Records are not moved to the new table all at once; instead, each
+ * insertion or removal moves the records of MIGRATE_STEP slots of the old
+ * table, so no single operation takes long. Until that is finished, records
+ * are looked up in both tables. A record removed from the old table keeps its
+ * key there (with a NULL `rec`) so the Robin Hood invariants still hold.
+ *
+ * Shards are cache-line aligned so threads working on different shards don't
+ * fight over the same cache line.
+ */
+struct Shard {
+    pthread_mutex_t mutex;
+    Slot*           slots;
+    size_t          mask;     // number of slots minus 1
+    size_t          count;    // number of used slots
+    Slot*           oldSlots; // old table being migrated, if any
+    size_t          oldMask;
+    size_t          migrated; // number of old slots already migrated
+    HeaderRecord*   records;  // header mode only
+    HeaderRecord*   scrubCursor; // next record to scrub, header mode only
+} __attribute__ (( aligned(64) ));
+typedef struct Shard Shard;
+
+
+/** Maximum number of pending records in a thread cache */
+#define MAX_CACHE 1024
+
+
+/** Number of slots of the set of pending records of a thread; at most half of
+ * them are used
+ */
+#define CACHE_SLOTS (2 * MAX_CACHE)
+
+
+/** A slot of the set of pending records of a thread; `key` is NULL if free */
+struct CacheSlot {
+    void*   key;
+    Record* rec;
+};
+typedef struct CacheSlot CacheSlot;
+
+
+/** Number of record slots moved at once between a thread and the global pool */
+#define SLAB_BATCH 64
+
+
+/** Size of the chunks record slots are carved from, in bytes */
+#define SLAB_CHUNK_SIZE (1024 * 1024)
+
+
+/** States of a trace ring buffer */
+#define RING_ACTIVE 0 // owned by a running thread
+#define RING_EXITED 1 // its thread has exited; waiting to be drained
+#define RING_FREE   2 // drained; can be taken by a new thread
+
+
+/** Trace ring buffer of one thread
+ *
+ * This is a single-producer single-consumer queue: the owning thread appends
+ * events at `head`, and the trace writer thread consumes them from `tail`.
+ * Both counters only ever increase; the ring is full when they are
+ * `TRACE_RING_EVENTS` apart, in which case new events are dropped rather than
+ * waiting for the writer. Rings are never freed; the ring of a thread which
+ * exits is given to the next new thread once it has been drained.
+ */
+struct TraceRing {
+    _Atomic uint64_t  head __attribute__ (( aligned(64) ));
+    _Atomic uint64_t  tail __attribute__ (( aligned(64) ));
+    _Atomic uint64_t  dropped; // number of events dropped because it was full
+    atomic_int        state;   // RING_xxx
+    uint16_t          thread;  // id of the owning thread in the events
+    struct TraceRing* next;    // single linked list of all the rings
+    FllocTraceEvent   events[TRACE_RING_EVENTS];
+};
+typedef struct TraceRing TraceRing;
+
+
+/** Per-thread state
+ *
+ * Each thread has its own list of free record slots, so allocating and freeing
+ * records normally takes no lock at all. Slots are moved by batches of
+ * SLAB_BATCH between this list and the global pool when the thread runs out of
+ * free slots or has too many of them.
+ *
+ * When the thread caches are enabled, a newly allocated record is not inserted
+ * in the global table straight away; it is added to the `pending` set of the
+ * allocating thread instead. This is a small open-addressed hash table keyed
+ * by the block, so finding a record in it doesn't depend on the size of the
+ * cache. A record freed by the same thread while still pending just disappears
+ * from the set, without ever touching the global table. The pending records
+ * are published in one batch when the set is full, when the thread exits and
+ * when flloc checks for memory leaks.
+ *
+ * The mutex is normally taken only by the owning thread; other threads take it
+ * when they free a block they can't find in the global table, or when they
+ * publish all the pending records.
+ */
+struct ThreadState {
+    pthread_mutex_t     mutex;
+    int                 registered;
+    int                 exited;
+    unsigned            count;
+    CacheSlot           pending[CACHE_SLOTS]; // `count` pending records
+    Record*             freeRecords; // single linked list of free slots
+    unsigned            freeCount;
+    unsigned            checkCount; // number of frees since last guard check
+    uint64_t            random;     // state of the random number generator
+    int64_t             sampleLeft; // bytes to allocate until next sample
+    uintptr_t           stackLow;   // bounds of the stack of this thread,
+    uintptr_t           stackHigh;  // if `STACK` is set
+    TraceRing*          trace;      // trace ring buffer, if `TRACE` is set
+    atomic_int          freeing;    // set while freeing a block, if LOCKFREE
+    struct ThreadState* next; // single linked list of registered threads
+};
+typedef struct ThreadState ThreadState;
+
+
+/** Special keys of the lock-free table */
+#define LF_EMPTY     ((uintptr_t)0)
+#define LF_TOMBSTONE ((uintptr_t)1)
+
+
+/** A slot of the lock-free table
+ *
+ * A slot starts EMPTY; an insertion claims an EMPTY or TOMBSTONE slot by
+ * atomically swapping its key for the record key, and a removal turns it back
+ * into a TOMBSTONE. A slot never goes back to EMPTY, so a search can stop at
+ * the first EMPTY slot it meets.
+ */
+struct LfSlot {
+    _Atomic uintptr_t key;
+    Record* _Atomic   rec;
+};
+typedef struct LfSlot LfSlot;
+
+
+
 
 /*------------------+
  | Global variables |
  +------------------*/
 
 
-/** Global mutex */
+/** Global mutex, used only for initialisation */
 static pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /** Is flloc initialised? */
-static int gInitialised = 0;
+static atomic_int gInitialised = 0;
 
 
 /** Where to write output */
@@ -75,383 +425,4231 @@ static FILE* gFile = NULL;
 static size_t gGuardSize_B = 1024;
 
 
-/** Rudimentary hash table of memory allocation records
+/** Header mode flag
  *
- * The key is bits 4 to 19 of the pointer as returned by `malloc()` and friends.
- * That makes 16 bits which should hopefully be more or less randomly
- * distributed.
+ * If set, each record is stored in a header at the start of its memory block,
+ * so freeing a block doesn't require any lookup.
  */
-static Record gRecords[REC_COUNT];
+static int gHeader = 0;
 
 
-/** Flag indicating whether memory leaks or corruptions have been detected */
-static int gAllGood = 1;
+/** Minimum alignment of the user blocks; a power of 2 */
+static size_t gAlign_B = NATURAL_ALIGN;
 
 
+/** Size of the front guard
+ *
+ * This is `gGuardSize_B` rounded up so user blocks are aligned to `gAlign_B`;
+ * the padding is filled and checked like the rest of the guard.
+ */
+static size_t gFrontGuard_B = 0;
 
-/*-------------------------------+
- | Private function declarations |
- +-------------------------------*/
+
+/** Number of bytes in front of each user block, including the front guard */
+static size_t gFrontSize_B = 0;
+
+
+/** Minimum size of blocks to place against a protected page; 0 to disable */
+static size_t gPageGuard_B = 0;
 
 
-/** Insert a record into the hash table
+/** Minimum size of blocks to allocate with `mmap()`; 0 to disable
  *
- * The key used is `rec->real`.
+ * Such blocks are resized with `mremap()`, which avoids copying their content.
+ */
+static size_t gMmap_B = 0;
+
+
+/** Place protected pages before the blocks rather than after them? */
+static int gPageUnderflow = 0;
+
+
+/** Size of a memory page, in bytes */
+static size_t gPageSize_B = 4096;
+
+
+/** Hash table of memory allocation records, split into shards
  *
- * @param rec [in,out] Record to insert
+ * The key is the pointer as returned by `malloc()` and friends. Its hash
+ * selects both the shard (using bits 48 and up) and the slot within the
+ * shard's table (using the lowest bits). Only the first `gShardCount` shards
+ * are used.
  */
-static void recordInsert(Record* rec);
+static Shard gShards[MAX_SHARDS];
 
 
-/** Remove a record identified by its key from the hash table
+/** Number of shards in use; always a power of 2 */
+static unsigned gShardCount = DEFAULT_SHARDS;
+
+
+/** Lock-free table of memory allocation records
  *
- * @param real [in] Key identifying the record to delete
+ * This is an open-addressed table with linear probing, which is used instead
+ * of `gShards` if the LOCKFREE parameter is set. It is allocated once and
+ * never grows, so it must be large enough for the peak number of live blocks.
+ */
+static LfSlot* gLfSlots = NULL;
+
+
+/** Number of slots in `gLfSlots` minus 1; the number of slots is a power of 2 */
+static size_t gLfMask = 0;
+
+
+/** Longest distance between a slot of the lock-free table and the slot its key
+ * hashes to; slots are never emptied, so lookups stop there rather than at an
+ * empty slot
+ */
+static atomic_size_t gLfProbeMax = 0;
+
+
+/** Set while the lock-free table is scanned at exit; blocks can't be freed
+ * meanwhile, see `freeBegin()`
+ */
+static atomic_int gLfPaused = 0;
+
+
+/** Mutex held during the scan, which threads wanting to free a block wait on */
+static pthread_mutex_t gLfPauseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Number of threads freeing a block which don't have a thread state */
+static atomic_int gLfFreeing = 0;
+
+
+/** Number of records a thread can keep before publishing them
  *
- * @return The removed record, or NULL if not found
+ * 0 means the thread caches are disabled.
  */
-static Record* recordRemove(void* real);
+static unsigned gCacheSize = 0;
 
 
-/** Initialise flloc if not done already
+/** Number of slots of the pending sets minus 1; a power of 2 minus 1 */
+static size_t gCacheMask = 0;
+
+
+/** State of the current thread */
+static __thread ThreadState tThread;
+
+
+/** List of registered threads, protected by `gThreadsMutex` */
+static ThreadState* gThreads = NULL;
+
+
+/** Mutex protecting `gThreads` */
+static pthread_mutex_t gThreadsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Key used to get notified when a thread exits */
+static pthread_key_t gThreadKey;
+
+
+/** Global pool of free record slots, protected by `gSlabMutex` */
+static Record* gFreeRecords = NULL;
+
+
+/** Unused part of the current chunk record slots are carved from */
+static void* gSlabPos = NULL;
+static void* gSlabEnd = NULL;
+
+
+/** Mutex protecting the global pool of record slots */
+static pthread_mutex_t gSlabMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+#ifdef FLLOC_PRELOAD
+/** Allocation functions of the C library (or of the next allocator in the
+ * chain), which flloc interposes in preload mode; found with `dlsym()`
+ */
+static void* (*gRealMalloc)(size_t);
+static void* (*gRealCalloc)(size_t, size_t);
+static void* (*gRealRealloc)(void*, size_t);
+static void (*gRealFree)(void*);
+static int (*gRealPosixMemalign)(void**, size_t, size_t);
+static size_t (*gRealUsableSize)(void*);
+
+
+/** Set while looking up the above functions
  *
- * Calling this function multiple times is harmless.
+ * `dlsym()` may allocate memory, which is then taken from `gBootstrap`.
  */
-static void initIfNeeded(void);
+static int gResolving = 0;
 
 
-/** Act on a configuration parameter */
-static void parseConfig(const char* name, const char* value);
+/** Arena for allocations made while looking up the above functions
+ *
+ * Blocks in this arena are never freed. Each one is preceded by its size.
+ */
+static uint8_t gBootstrap[BOOTSTRAP_SIZE] __attribute__ (( aligned(16) ));
 
 
-/** Allocate memory
+/** Number of bytes used in `gBootstrap` */
+static atomic_size_t gBootstrapUsed = 0;
+
+
+/** Set while the current thread runs flloc code
  *
- * This function allocates (or re-allocates if `old` is not NULL) memory. It
- * updates the hash table accordingly to keep track of allocated memory chunks.
+ * Any memory the C library allocates on behalf of flloc then comes straight
+ * from the real functions. This is what makes the interposed functions safe to
+ * call recursively.
+ */
+static __thread int tInside;
+#endif
+
+
+/** Flag indicating whether memory leaks or corruptions have been detected */
+static atomic_int gAllGood = 1;
+
+
+/** Allocation sites
  *
- * @param p [in] Pointer to memory to re-allocate; may be NULL
- * @param size [in] Number of bytes to allocate; may be NULL
- * @param file [in] Path to source file; may be NULL
- * @param line [in] Line in above source file; may be <=0
+ * Site 0 is used when `MAX_SITES` is reached; it has no file and no line.
+ */
+static Site gSites[MAX_SITES];
+
+
+/** Number of sites in use */
+static atomic_uint gSiteCount = 1;
+
+
+/** Hash table to look up sites, keyed by file and line
  *
- * @return Pointer usable by the caller, or NULL if failed uto allocate
+ * Each slot holds a site index, or 0 if empty. This table is twice as large as
+ * `gSites` so it never gets full. It is read without any lock; sites are added
+ * with `gSiteMutex` held.
+ */
+static atomic_uint gSiteIndex[2 * MAX_SITES];
+
+
+/** Mutex protecting the addition of new sites */
+static pthread_mutex_t gSiteMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Print statistics for each allocation site at exit? */
+static int gStats = 0;
+
+
+/** Mean number of bytes between sampled allocations; 0 to track all blocks */
+static size_t gSampleMean = 0;
+
+
+/** Number of bytes in front of the blocks which are not sampled, including the
+ * tag; this keeps them aligned to `gAlign_B`
+ */
+static size_t gUntrackedFront_B = SAMPLE_TAG_SIZE;
+
+
+/** Maximum number of frames recorded for each call stack; 0 to disable */
+static unsigned gStackDepth = 0;
+
+
+/** Call stacks
+ *
+ * Stack `i` is made of `gStackSizes[i]` return addresses, stored from
+ * `gStackFrames[i * gStackDepth]`. Stacks are hash-consed, so records just
+ * hold an index. Stack 0 is unknown; it is used when `MAX_STACKS` is reached.
+ * These arrays are reserved when flloc is initialised and grow on demand.
+ */
+static void** gStackFrames = NULL;
+static uint8_t* gStackSizes = NULL;
+
+
+/** Number of stacks in use */
+static atomic_uint gStackCount = 1;
+
+
+/** Hash table to look up stacks; works like `gSiteIndex` */
+static atomic_uint* gStackIndex = NULL;
+
+
+/** Mutex protecting the addition of new stacks */
+static pthread_mutex_t gStackMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Print leaked blocks grouped by allocation site? */
+static int gReportGrouped = 0;
+
+
+/** Number of threads scanning for memory leaks at exit */
+static unsigned gScanThreads = 1;
+
+
+/** Guard checking policies when a block is freed */
+enum CheckPolicy {
+    CHECK_ALL,    // check the guards of every block
+    CHECK_EVERY,  // check the guards of one block every `gCheckParam` blocks
+    CHECK_RANDOM, // check the guards with a probability of `gCheckParam` / 2^32
+    CHECK_EDGE    // check only `gCheckParam` bytes of each guard, next to the
+                  // user block
+};
+
+
+/** How to check guards when a block is freed
+ *
+ * Whatever the policy, the guards of the blocks still allocated are fully
+ * checked at exit.
+ */
+static enum CheckPolicy gCheckPolicy = CHECK_ALL;
+
+
+/** Parameter of the guard checking policy */
+static uint64_t gCheckParam = 0;
+
+
+/** Has the CHECK parameter been set explicitly? */
+static int gCheckSet = 0;
+
+
+/** Number of blocks per second the scrubbing thread checks; 0 to disable it */
+static unsigned long gScrubRate = 0;
+
+
+/** File the allocation events are written to; -1 if tracing is disabled */
+static int gTraceFd = -1;
+
+
+/** File the locations of the allocation sites are written to when tracing */
+static FILE* gTraceSites = NULL;
+
+
+/** List of all the trace ring buffers */
+static TraceRing* _Atomic gTraceRings = NULL;
+
+
+/** Number of thread ids given to trace ring buffers so far */
+static atomic_uint gTraceThreads = 0;
+
+
+/** Number of events lost because a thread had no ring buffer */
+static _Atomic uint64_t gTraceLost = 0;
+
+
+/** Set to ask the trace writer thread to write the last events and stop */
+static atomic_int gTraceStop = 0;
+
+
+/** Trace writer thread */
+static pthread_t gTraceThread;
+
+
+/** Header of the trace file; the counters are kept by the trace writer thread,
+ * and the header is written again with them at exit
  */
-static void* doRealloc(void* old, size_t size, const char* file, int line);
+static FllocTraceHeader gTraceHeader = {
+    FLLOC_TRACE_MAGIC, FLLOC_TRACE_VERSION, sizeof(FllocTraceEvent), 0, 0
+};
+
+
+/** Function used to look for corrupted bytes in a guard buffer
+ *
+ * This is set at initialisation time to the fastest implementation the CPU
+ * supports.
+ */
+static uint8_t* (*gGuardScan)(uint8_t* p, size_t size) = NULL;
+
+
+
+/*-------------------------------+
+ | Private function declarations |
+ +-------------------------------*/
+
+
+/** Insert a record into the hash table (or the lock-free table if enabled)
+ *
+ * The key used is `rec->ptr`.
+ *
+ * @param rec [in,out] Record to insert
+ */
+static void recordInsert(Record* rec);
+
+
+/** Remove a record identified by its key from the hash table
+ *
+ * @param ptr  [in] Key identifying the record to delete
+ *
+ * @return The removed record, or NULL if not found
+ */
+static Record* recordRemove(void* ptr);
+
+
+/** Insert many records into the hash table (or the lock-free table)
+ *
+ * This is more efficient than inserting them one by one, because each shard is
+ * locked only once.
+ *
+ * @param recs  [in] Records to insert
+ * @param count [in] Number of records in `recs`
+ */
+static void recordInsertBatch(Record** recs, unsigned count);
+
+
+/** Link a record into the list of its shard (header mode) */
+static void headerInsert(Record* rec);
+
+
+/** Validate the header of a block and unlink its record (header mode)
+ *
+ * @return The removed record; this function aborts if the header is invalid
+ */
+static Record* headerRemove(void* ptr);
+
+
+/** Compute the checksum of a block header
+ *
+ * This covers every field used to free the block or to unlink its record,
+ * so a header overwritten by an underflow is caught before any of them is
+ * used. `FLAG_REPORTED` is left out, as it is set when a corruption is found,
+ * without updating the checksum. As the checksum covers the links of the list,
+ * it must be updated, with the shard mutex held, whenever they change.
+ */
+static uint64_t headerChecksum(const HeaderRecord* hdr);
+
+
+/** Check the header of a block before changing it; this function aborts if
+ * the header is corrupted
+ */
+static void headerCheck(const HeaderRecord* hdr);
+
+
+/** Insert a record into the table of a shard; `shard->mutex` must be held */
+static void tableInsert(Shard* shard, Record* rec);
+
+
+/** Remove a record from the table of a shard; `shard->mutex` must be held
+ *
+ * @return The removed record, or NULL if not found
+ */
+static Record* tableRemove(Shard* shard, void* ptr);
+
+
+/** Find a record in a table
+ *
+ * @param slots [in]  Table to search
+ * @param mask  [in]  Number of slots in the table minus 1
+ * @param ptr   [in]  Key of the record to find
+ * @param pos   [out] Index of the slot holding the record, if found
+ *
+ * @return 1 if found, 0 if not found
+ */
+static int slotFind(Slot* slots, size_t mask, void* ptr, size_t* pos);
+
+
+/** Start doubling the size of the table of a shard
+ *
+ * The current table becomes the old table, and its records are moved to the
+ * new table bit by bit by `tableMigrate()`. `shard->mutex` must be held.
+ */
+static void tableGrow(Shard* shard);
+
+
+/** Move records from the old table of a shard to its current table
+ *
+ * @param shard [in,out] Shard to work on; its mutex must be held
+ * @param count [in]     Maximum number of slots of the old table to process
+ */
+static void tableMigrate(Shard* shard, size_t count);
+
+
+/** Allocate a table of empty slots; this function aborts if it fails */
+static Slot* tableAlloc(size_t count);
+
+
+/** Insert a record into the lock-free table */
+static void lfInsert(Record* rec);
+
+
+/** Remove a record from the lock-free table
+ *
+ * @return The removed record, or NULL if not found
+ */
+static Record* lfRemove(void* ptr);
+
+
+/** Find the slot of a key in the lock-free table
+ *
+ * This waits for the record of the slot to be stored, if the key has just been
+ * inserted.
+ *
+ * @return The slot holding `ptr`, or NULL if not found
+ */
+static LfSlot* lfSlotFind(void* ptr);
+
+
+#ifdef FLLOC_PRELOAD
+
+/** Find the record of a block, leaving it where it is
+ *
+ * This looks in the thread cache, then in the table. The record may only be
+ * used while its block can't be freed, e.g. by the thread which owns it.
+ *
+ * @return The record, or NULL if not found
+ */
+static Record* trackFind(void* ptr);
+
+
+/** Find a record in the hash table (or the lock-free table), leaving it there
+ *
+ * @return The record, or NULL if not found
+ */
+static Record* recordFind(void* ptr);
+
+#endif
+
+
+/** Start tracking a newly allocated record
+ *
+ * This goes through the thread cache if enabled, or straight into the table
+ * otherwise.
+ */
+static void trackInsert(Record* rec);
+
+
+/** Start freeing a block
+ *
+ * In LOCKFREE mode, nothing stops the leak scan at exit from reading a record
+ * which is being freed, so blocks are not freed while the lock-free table is
+ * scanned: this waits for the scan to finish, and flags the thread as freeing
+ * a block until `freeEnd()` is called. This does nothing in other modes, where
+ * the scan locks the shards.
+ *
+ * @return The state of the current thread, to give to `freeEnd()`
+ */
+static ThreadState* freeBegin(void);
+
+
+/** Done freeing a block; see `freeBegin()` */
+static void freeEnd(ThreadState* ts);
+
+
+/** Wait for the blocks being freed, and stop other blocks from being freed
+ * until `lfResumeFrees()` is called
+ */
+static void lfPauseFrees(void);
+
+
+/** Let threads free blocks again after `lfPauseFrees()` */
+static void lfResumeFrees(void);
+
+
+/** Stop tracking a record
+ *
+ * The record may be anywhere: in the cache of the current thread, in the
+ * global table or in the cache of another thread.
+ *
+ * @param ptr  [in] Key identifying the record to delete
+ *
+ * @return The removed record, or NULL if not found
+ */
+static Record* trackRemove(void* ptr);
+
+
+/** Allocate a record slot
+ *
+ * Record slots are carved from large chunks of memory obtained with `mmap()`,
+ * so they don't cost any call to `malloc()`.
+ *
+ * @return A record slot; this function aborts if it runs out of memory
+ */
+static Record* recordAlloc(void);
+
+
+/** Release a record slot allocated by `recordAlloc()` */
+static void recordFree(Record* rec);
+
+
+/** Move up to `count` slots from the global pool to the given list
+ *
+ * @param list [in,out] List to add slots to
+ *
+ * @return The number of slots actually moved
+ */
+static unsigned slabGet(Record** list, unsigned count);
+
+
+/** Move `count` slots from the given list to the global pool */
+static void slabPut(Record** list, unsigned count);
+
+
+/** Get the state of the current thread, registering it if necessary
+ *
+ * @return The state of the current thread, or NULL if the thread is exiting
+ */
+static ThreadState* threadState(void);
+
+
+/** Add a record to the pending set of a thread; `ts->mutex` must be held
+ *
+ * The set must not be full.
+ */
+static void cachePut(ThreadState* ts, Record* rec);
+
+
+/** Find a pending record of a thread; `ts->mutex` must be held
+ *
+ * @param ts     [in,out] Thread to search
+ * @param ptr    [in]     Block to find
+ * @param remove [in]     If not 0, the record is removed from the set
+ *
+ * @return The record, or NULL if not found
+ */
+static Record* cacheLookup(ThreadState* ts, void* ptr, int remove);
+
+
+/** Find a pending record of any thread
+ *
+ * This is used for blocks freed by another thread than the one which allocated
+ * them, before they are published.
+ *
+ * @param ptr    [in] Block to find
+ * @param remove [in] If not 0, the record is removed from the set
+ *
+ * @return The record, or NULL if not found
+ */
+static Record* cacheLookupAll(void* ptr, int remove);
+
+
+/** Publish all the pending records of a thread; `ts->mutex` must be held */
+static void cacheFlush(ThreadState* ts);
+
+
+/** Publish the pending records of all the threads */
+static void cacheFlushAll(void);
+
+
+/** Called when a thread exits */
+static void threadExit(void* arg);
+
+
+/** Initialise flloc if not done already
+ *
+ * Calling this function multiple times is harmless. It is also thread-safe.
+ */
+static void initIfNeeded(void);
+
+
+/** Actually initialise flloc; called once with `gMutex` held */
+static void doInit(void);
+
+
+/** Act on a configuration parameter */
+static void parseConfig(const char* name, const char* value);
+
+
+/** Allocate memory
+ *
+ * This function allocates (or re-allocates if `old` is not NULL) memory. It
+ * updates the hash table accordingly to keep track of allocated memory chunks.
+ *
+ * @param p [in] Pointer to memory to re-allocate; may be NULL
+ * @param size [in] Number of bytes to allocate; may be NULL
+ * @param site [in] Index of the allocation site
+ * @param stack [in] Index of the call stack, as returned by `stackCapture()`
+ *
+ * @return Pointer usable by the caller, or NULL if failed uto allocate
+ */
+static void* doRealloc(void* old, size_t size, uint32_t site, uint32_t stack);
+
+
+/** Allocate a memory block and its record, and fill in its guards
+ *
+ * The record is not tracked yet, but it is accounted for in its site. If `size`
+ * is so large that adding the guards would overflow, `errno` is set to
+ * `ENOMEM` and NULL is returned.
+ *
+ * When `align` is larger than the minimum alignment `gAlign_B` (see `ALIGN`),
+ * the front guard is padded so the user block is aligned; this wastes less
+ * than `align` bytes.
+ *
+ * @param size  [in] Size of the user block
+ * @param zero  [in] If not 0, the user block is initialised to zero
+ * @param align [in] Alignment of the user block, a power of 2; 0 for the
+ *                   minimum alignment `gAlign_B`
+ * @param site  [in] Index of the allocation site
+ * @param stack [in] Index of the call stack
+ *
+ * @return The new record, or NULL if out of memory
+ */
+static Record* allocBlock(size_t size, int zero, size_t align, uint32_t site,
+        uint32_t stack);
+
+
+/** Allocate a memory block against a protected page
+ *
+ * The block gets its own mapping, with a page which can't be accessed just
+ * after it (or just before it if `gPageUnderflow` is set), so any access
+ * beyond the end (or before the start) of the block faults immediately.
+ *
+ * @param size  [in] Size of the user block
+ * @param align [in] Alignment of the user block, at least `gAlign_B` and at
+ *                   most a page
+ *
+ * @return The new record, or NULL if out of memory
+ */
+static Record* allocPageGuarded(size_t size, size_t align);
+
+
+/** Allocate a memory block with its own mapping
+ *
+ * @param size  [in] Size of the user block
+ * @param align [in] Alignment of the user block, at least `gAlign_B` and at
+ *                   most a page
+ *
+ * @return The new record, or NULL if out of memory
+ */
+static Record* allocMapped(size_t size, size_t align);
+
+
+/** Get a record for a block whose user pointer is `ptr` */
+static Record* newRecord(void* ptr);
+
+
+/** Try to resize a block without copying its content
+ *
+ * This works if the underlying allocator gave us enough room, or if the block
+ * has its own mapping, in which case it is resized with `mremap()` and may
+ * move. The back guard is moved to the new end of the block.
+ *
+ * @param rec  [in,out] Record of the block to resize; it must not be tracked
+ * @param size [in]     New size of the block
+ *
+ * @return The record of the resized block (which is different from `rec` if
+ *         the block moved in header mode), or NULL if it can't be resized
+ */
+static Record* resizeBlock(Record* rec, size_t size);
+
+
+/** Free a memory block and its record */
+static void releaseBlock(Record* rec);
+
+
+/** Report a block being freed by the wrong function, if that is the case
+ *
+ * @param rec  [in] Record of the block being freed
+ * @param kind [in] How the block is being freed, as a `FLLOC_KIND_xxx`
+ */
+static void checkKind(const Record* rec, int kind);
+
+
+/** Get the index of the site for the given file and line (or caller, if the
+ * file is not known), adding it if needed
+ */
+static uint32_t siteIntern(const char* file, int line, void* caller);
+
+
+/** Size of a buffer large enough for `siteFormat()` */
+#define SITE_BUF_SIZE 512
+
+
+/** Format the location of a site, as "file:line" or as a return address */
+static void siteFormat(uint32_t site, char* buf, size_t size);
+
+
+/** Get the index of the given call stack, adding it if needed
+ *
+ * @param frames [in] Return addresses, innermost first
+ * @param n      [in] Number of return addresses in `frames`
+ *
+ * @return Index of the stack, or 0 if there is no room left
+ */
+static uint32_t stackIntern(void* const* frames, unsigned n);
+
+
+/** Format a call stack as a list of return addresses, each preceded by a space
+ *
+ * @param stack [in]  Index of the call stack; if 0, `buf` is set to ""
+ * @param buf   [out] Where to write the string
+ * @param size  [in]  Size of `buf`
+ */
+static void stackFormat(uint32_t stack, char* buf, size_t size);
+
+
+/** Size of a buffer large enough for `stackFormat()` */
+#define STACK_BUF_SIZE (16 + (MAX_STACK_DEPTH * 20))
+
+
+/** Get the next random number of the calling thread */
+static uint64_t threadRandom(void);
+
+
+/** Decide whether an allocation must be sampled
+ *
+ * The distance in bytes between two samples follows an exponential
+ * distribution with a mean of `gSampleMean`, so an allocation of `size` bytes
+ * is sampled with a probability of `1 - exp(-size / gSampleMean)`.
+ *
+ * @param size [in] Size of the allocation
+ *
+ * @return 1 if the allocation must be tracked, 0 if not
+ */
+static int sampleTake(size_t size);
+
+
+/** Get the estimated number of blocks a sampled block of `size` bytes stands
+ * for; this is 1 if sampling is disabled
+ */
+static double sampleWeight(size_t size);
+
+
+/** Allocate a block which is not tracked, with a tag in front of it
+ *
+ * @param size [in] Size of the user block
+ * @param zero [in] If not 0, the user block is initialised to zero
+ *
+ * @return The user pointer, or NULL if out of memory
+ */
+static void* untrackedAlloc(size_t size, int zero);
+
+
+/** Re-allocate a block which is not tracked, into another untracked block */
+static void* untrackedRealloc(void* ptr, size_t size);
+
+
+/** Free a block which is not tracked */
+static void untrackedFree(void* ptr);
+
+
+/** Check whether a block has been allocated by `untrackedAlloc()` */
+static inline int isUntracked(void* ptr)
+{
+    const uint64_t* tag = ptr - SAMPLE_TAG_SIZE;
+    return tag[0] == (SAMPLE_MAGIC ^ (uintptr_t)ptr);
+}
+
+
+/** Get the size of a block allocated by `untrackedAlloc()` */
+static inline size_t untrackedSize(void* ptr)
+{
+    return ((const uint64_t*)(ptr - SAMPLE_TAG_SIZE))[1];
+}
+
+
+/** Account for a block allocated from the given site */
+static void siteAlloc(uint32_t site, size_t size);
+
+
+/** Account for a block allocated from the given site being freed */
+static void siteFree(uint32_t site, size_t size);
+
+
+/** Print statistics for all allocation sites */
+static void printStats(void);
+
+
+/** Initialise the guard buffers if applicable */
+static void fillGuard(Record* rec);
+
+
+/** Check for signs of corruption in the guard buffers */
+static void checkForCorruption(Record* rec);
+
+
+/** Check the guard buffers of a block being freed, according to the policy */
+static void checkOnFree(Record* rec);
+
+
+/** Check for corruption in the given number of guard bytes on each side of a
+ * block, starting next to the user block
+ */
+static void checkGuards(Record* rec, size_t size);
+
+
+/** Find the first corrupted byte of a guard buffer, 64 bits at a time
+ *
+ * @param p    [in] Start of the area to check
+ * @param size [in] Number of bytes to check
+ *
+ * @return Pointer to the first byte which is not FLLOC_FILL, or NULL if all
+ *         bytes are good
+ */
+static uint8_t* guardScanWord(uint8_t* p, size_t size);
+
+
+#ifdef __x86_64__
+/** Same as `guardScanWord()`, but using SSE2 instructions */
+static uint8_t* guardScanSse2(uint8_t* p, size_t size);
+
+
+/** Same as `guardScanWord()`, but using AVX2 instructions */
+static uint8_t* guardScanAvx2(uint8_t* p, size_t size);
+#endif
+
+
+/** Check the guards of a leaked block and report it
+ *
+ * @param rec   [in]     Record of the leaked block
+ * @param leaks [in,out] Leaks per site, indexed by site; if NULL, the block is
+ *                       reported straight away
+ */
+static void reportLeak(Record* rec, LeakSite* leaks);
+
+
+/** Body of a thread scanning for memory leaks at exit
+ *
+ * All the shard mutexes must be held by the thread calling `fllocCheck()`.
+ *
+ * @param arg [in,out] The `Scanner` of this thread
+ *
+ * @return Always NULL
+ */
+static void* scanThread(void* arg);
+
+
+/** Allocate a zeroed array to collect leaks per site; return NULL on failure */
+static LeakSite* leaksAlloc(void);
+
+
+/** Add the leaks in `src` to `dst` */
+static void leaksMerge(LeakSite* dst, const LeakSite* src);
+
+
+/** Print a grouped leak report, the sites leaking the most bytes first
+ *
+ * @param leaks [in,out] Leaks per site, as filled in by `reportLeak()`; it is
+ *                       sorted in place
+ */
+static void printLeaks(LeakSite* leaks);
+
+
+/** Body of the scrubbing thread
+ *
+ * This thread goes round all the shards forever, checking the guards of the
+ * blocks which are still allocated, at a rate of `gScrubRate` blocks per
+ * second.
+ */
+static void* scrubThread(void* arg);
+
+
+/** Scrub the next batch of blocks of a shard
+ *
+ * @param shard [in,out] Shard to scrub; its mutex must be held
+ * @param pos   [in,out] Position of the next slot to scrub in the shard table
+ * @param count [out]    Number of blocks checked
+ *
+ * @return 1 if the whole shard has been scrubbed, 0 otherwise
+ */
+static int scrubShard(Shard* shard, size_t* pos, unsigned* count);
+
+
+/** Record an allocation event in the ring buffer of the current thread
+ *
+ * This never blocks: if the ring buffer is full, the event is dropped.
+ *
+ * @param type [in] Type of the event, as a `FLLOC_TRACE_xxx`
+ * @param ptr  [in] User pointer of the block
+ * @param size [in] Size of the block
+ * @param site [in] Site the block has been allocated from
+ */
+static void traceRecord(int type, void* ptr, size_t size, uint32_t site);
+
+
+/** Record an allocation event, if tracing is enabled; see `traceRecord()` */
+static inline void traceEvent(int type, void* ptr, size_t size, uint32_t site)
+{
+    if ((gTraceFd >= 0) && (ptr != NULL)) {
+        traceRecord(type, ptr, size, site);
+    }
+}
+
+
+/** Get the trace ring buffer of the current thread, creating it if needed
+ *
+ * @return The ring buffer, or NULL if the thread is exiting or out of memory
+ */
+static TraceRing* traceRing(void);
+
+
+/** Write a buffer to the trace file; errors are reported only once */
+static void traceWrite(const void* buf, size_t size);
+
+
+/** Body of the trace writer thread
+ *
+ * This thread keeps moving the events from the ring buffers of all the threads
+ * to the trace file, until `gTraceStop` is set.
+ */
+static void* traceThread(void* arg);
+
+
+/** Write the events in all the ring buffers to the trace file
+ *
+ * @return The number of events written
+ */
+static size_t traceDrain(void);
+
+
+/** Stop the trace writer thread, and complete the trace files */
+static void traceFinish(void);
+
+
+/** Function to be run at the very end to check for memory leaks */
+static void fllocCheck(void);
+
+
+/* Allocation functions of the C library, used for the blocks flloc tracks and
+ * for its own needs; in preload mode, these bypass the interposed functions
+ */
+
+#ifdef FLLOC_PRELOAD
+
+static inline void* sysMalloc(size_t size)
+{
+    return gRealMalloc(size);
+}
+
+
+static inline void* sysCalloc(size_t nmemb, size_t size)
+{
+    return gRealCalloc(nmemb, size);
+}
+
+
+static inline void* sysRealloc(void* ptr, size_t size)
+{
+    return gRealRealloc(ptr, size);
+}
+
+
+static inline void sysFree(void* ptr)
+{
+    gRealFree(ptr);
+}
+
+
+static inline void* sysMemalign(size_t align, size_t size)
+{
+    void* ptr;
+    return (gRealPosixMemalign(&ptr, align, size) == 0) ? ptr : NULL;
+}
+
+
+static inline size_t sysUsableSize(void* ptr)
+{
+    return gRealUsableSize(ptr);
+}
+
+#else
+
+static inline void* sysMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+
+static inline void* sysCalloc(size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+
+static inline void* sysRealloc(void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+
+static inline void sysFree(void* ptr)
+{
+    free(ptr);
+}
+
+
+static inline void* sysMemalign(size_t align, size_t size)
+{
+    void* ptr;
+    return (posix_memalign(&ptr, align, size) == 0) ? ptr : NULL;
+}
+
+
+static inline size_t sysUsableSize(void* ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+#endif
+
+
+
+/** Record the call stack of the caller of the current public function
+ *
+ * This walks the chain of frame pointers, so it works best when the program is
+ * compiled with `-fno-omit-frame-pointer`; the walk stops at the first frame
+ * pointer which looks wrong. This function must be inlined, so the walk starts
+ * from the frame of the public function which called it.
+ *
+ * @param caller [in] Return address of the call to the allocation function
+ *                    made by the program, or NULL if unknown; the frames of
+ *                    the wrappers inside flloc (e.g. `operator new`) found
+ *                    before it are skipped
+ *
+ * @return Index of the call stack, or 0 if `STACK` is not set
+ */
+static inline __attribute__ (( always_inline )) uint32_t stackCapture(
+        void* caller)
+{
+    if (0 == gStackDepth) {
+        return 0;
+    }
+    if (0 == tThread.stackHigh) {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+            return 0;
+        }
+        int err = pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            return 0;
+        }
+        tThread.stackLow = (uintptr_t)addr;
+        tThread.stackHigh = (uintptr_t)addr + size;
+    }
+
+    void* frames[MAX_STACK_DEPTH + STACK_MAX_SKIP];
+    unsigned n = 0;
+    uintptr_t* fp = __builtin_frame_address(0);
+    while (n < (gStackDepth + STACK_MAX_SKIP)) {
+        uintptr_t addr = (uintptr_t)fp;
+        if ((addr < tThread.stackLow)
+                || ((addr + (2 * sizeof(*fp))) > tThread.stackHigh)
+                || (addr & (sizeof(*fp) - 1))) {
+            break;
+        }
+        if (0 == fp[1]) {
+            break;
+        }
+        frames[n++] = (void*)fp[1];
+        uintptr_t* next = (uintptr_t*)fp[0];
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+
+    unsigned skip = 0;
+    while ((caller != NULL) && (skip < n) && (skip <= STACK_MAX_SKIP)
+            && (frames[skip] != caller)) {
+        skip++;
+    }
+    if ((skip >= n) || (skip > STACK_MAX_SKIP)) {
+        skip = 0;
+    }
+    n -= skip;
+    if (n > gStackDepth) {
+        n = gStackDepth;
+    }
+    return stackIntern(frames + skip, n);
+}
+
+
+/** Allocate a block for a public function
+ *
+ * This function and the ones below must be inlined, so `stackCapture()` starts
+ * from the frame of the public function.
+ *
+ * @param size   [in] Size of the block
+ * @param file   [in] Path to source file; may be NULL
+ * @param line   [in] Line in above source file
+ * @param caller [in] Return address of the public function; used as the site
+ *                    when `file` is NULL
+ *
+ * @return The user pointer, or NULL if out of memory
+ */
+static inline __attribute__ (( always_inline )) void* allocPublic(size_t size,
+        const char* file, int line, void* caller)
+{
+    if (0 == size) {
+        return NULL;
+    }
+    if ((gSampleMean > 0) && !sampleTake(size)) {
+        void* ptr = untrackedAlloc(size, 0);
+        if (gTraceFd >= 0) {
+            traceEvent(FLLOC_TRACE_MALLOC, ptr, size,
+                    siteIntern(file, line, caller));
+        }
+        return ptr;
+    }
+    return doRealloc(NULL, size, siteIntern(file, line, caller),
+            stackCapture(caller));
+}
+
+
+/** Allocate a zeroed array for a public function; see `allocPublic()` */
+static inline __attribute__ (( always_inline )) void* callocPublic(
+        size_t nmemb, size_t mbsize, const char* file, int line, void* caller)
+{
+    if ((mbsize != 0) && (nmemb > (SIZE_MAX / mbsize))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t size = nmemb * mbsize;
+    if (0 == size) {
+        return NULL;
+    }
+
+    if ((gSampleMean > 0) && !sampleTake(size)) {
+        void* ptr = untrackedAlloc(size, 1);
+        if (gTraceFd >= 0) {
+            traceEvent(FLLOC_TRACE_MALLOC, ptr, size,
+                    siteIntern(file, line, caller));
+        }
+        return ptr;
+    }
+
+    // NB: `calloc(3)` is supposed to initialise the memory to 0; get memory
+    // which is already zeroed rather than clearing it ourselves, so large
+    // blocks can use fresh pages from the kernel
+    Record* rec = allocBlock(size, 1, 0, siteIntern(file, line, caller),
+            stackCapture(caller));
+    if (NULL == rec) {
+        return NULL;
+    }
+    trackInsert(rec);
+    traceEvent(FLLOC_TRACE_MALLOC, rec->ptr, size, rec->site);
+    return rec->ptr;
+}
+
+
+/** Re-allocate a block for a public function; see `allocPublic()` */
+static inline __attribute__ (( always_inline )) void* reallocPublic(void* old,
+        size_t size, const char* file, int line, void* caller)
+{
+    if ((gSampleMean > 0) && (size > 0)
+            && ((NULL == old) || isUntracked(old))) {
+        if (!sampleTake(size)) {
+            if (NULL == old) {
+                void* ptr = untrackedAlloc(size, 0);
+                if (gTraceFd >= 0) {
+                    traceEvent(FLLOC_TRACE_MALLOC, ptr, size,
+                            siteIntern(file, line, caller));
+                }
+                return ptr;
+            }
+            size_t oldSize = untrackedSize(old);
+            void* ptr = untrackedRealloc(old, size);
+            if ((gTraceFd >= 0) && (ptr != NULL)) {
+                traceEvent(FLLOC_TRACE_FREE, old, oldSize, 0);
+                traceEvent(FLLOC_TRACE_REALLOC, ptr, size,
+                        siteIntern(file, line, caller));
+            }
+            return ptr;
+        }
+        if (old != NULL) {
+            // The new block is sampled, but not the old one
+            void* ptr = doRealloc(NULL, size, siteIntern(file, line, caller),
+                    stackCapture(caller));
+            if (ptr != NULL) {
+                size_t oldSize = untrackedSize(old);
+                memcpy(ptr, old, (size < oldSize) ? size : oldSize);
+                traceEvent(FLLOC_TRACE_FREE, old, oldSize, 0);
+                untrackedFree(old);
+            }
+            return ptr;
+        }
+    }
+    ThreadState* ts = freeBegin();
+    void* ptr = doRealloc(old, size, siteIntern(file, line, caller),
+            stackCapture(caller));
+    freeEnd(ts);
+    return ptr;
+}
+
+
+/** Round an alignment up to a power of 2, like `memalign()` in the GNU C
+ * library does
+ *
+ * @return The rounded alignment, or 0 if `align` is too large to be rounded
+ */
+static inline size_t alignRoundUp(size_t align)
+{
+    if (align > ((SIZE_MAX / 2) + 1)) {
+        return 0;
+    }
+    size_t pow2 = 1;
+    while (pow2 < align) {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+
+/** Allocate an aligned block for a public function; see `allocPublic()`
+ *
+ * NB: Aligned blocks are always tracked, even when sampling.
+ *
+ * @param align [in] Alignment, a power of 2
+ */
+static inline __attribute__ (( always_inline )) void* alignedPublic(
+        size_t align, size_t size, const char* file, int line, void* caller)
+{
+    if (0 == size) {
+        return NULL;
+    }
+    Record* rec = allocBlock(size, 0, align, siteIntern(file, line, caller),
+            stackCapture(caller));
+    if (NULL == rec) {
+        return NULL;
+    }
+    trackInsert(rec);
+    traceEvent(FLLOC_TRACE_MALLOC, rec->ptr, size, rec->site);
+    return rec->ptr;
+}
+
+
+
+/*------------------------------------+
+ | Implementation of public functions |
+ +------------------------------------*/
+
+
+void* FllocMalloc(size_t size, const char* file, int line)
+{
+    initIfNeeded();
+    return allocPublic(size, file, line, NULL);
+}
+
+
+void* FllocCalloc(size_t nmemb, size_t mbsize, const char* file, int line)
+{
+    initIfNeeded();
+    return callocPublic(nmemb, mbsize, file, line, NULL);
+}
+
+
+void* FllocRealloc(void* old, size_t size, const char* file, int line)
+{
+    initIfNeeded();
+    return reallocPublic(old, size, file, line, NULL);
+}
+
+
+void FllocFree(void* ptr, const char* file, int line)
+{
+    if (NULL == ptr) {
+        return;
+    }
+    initIfNeeded();
+    if ((gSampleMean > 0) && isUntracked(ptr)) {
+        traceEvent(FLLOC_TRACE_FREE, ptr, untrackedSize(ptr), 0);
+        untrackedFree(ptr);
+        return;
+    }
+    ThreadState* ts = freeBegin();
+    Record* rec = trackRemove(ptr);
+    if (NULL == rec) {
+        freeEnd(ts);
+#ifdef FLLOC_PRELOAD
+        // Allocated by the C library while we could not track it
+        sysFree(ptr);
+        return;
+#else
+        fprintf(stderr, "FLLOC FATAL: Unknown pointer %p when freeing memory\n",
+                ptr);
+        abort();
+#endif
+    }
+    checkKind(rec, FLLOC_KIND_MALLOC);
+    checkOnFree(rec);
+    traceEvent(FLLOC_TRACE_FREE, ptr, rec->size, rec->site);
+    releaseBlock(rec);
+    freeEnd(ts);
+}
+
+
+void* FllocNew(size_t size, size_t align, int kind, const char* file,
+        int line, void* caller)
+{
+    initIfNeeded();
+    if (0 == size) {
+        size = 1; // `operator new` must return a unique pointer
+    }
+    if ((0 == align) && (gSampleMean > 0) && !sampleTake(size)) {
+        void* ptr = untrackedAlloc(size, 0);
+        if (gTraceFd >= 0) {
+            traceEvent(FLLOC_TRACE_MALLOC, ptr, size,
+                    siteIntern(file, line, caller));
+        }
+        return ptr;
+    }
+    Record* rec = allocBlock(size, 0, align, siteIntern(file, line, caller),
+            stackCapture(caller));
+    if (NULL == rec) {
+        return NULL;
+    }
+    rec->flags |= (kind << FLAG_KIND_SHIFT) & FLAG_KIND_MASK;
+    trackInsert(rec);
+    traceEvent(FLLOC_TRACE_MALLOC, rec->ptr, size, rec->site);
+    return rec->ptr;
+}
+
+
+void FllocDelete(void* ptr, size_t size, int kind, const char* file, int line)
+{
+    if (NULL == ptr) {
+        return;
+    }
+    initIfNeeded();
+    if ((gSampleMean > 0) && isUntracked(ptr)) {
+        traceEvent(FLLOC_TRACE_FREE, ptr, untrackedSize(ptr), 0);
+        untrackedFree(ptr);
+        return;
+    }
+    ThreadState* ts = freeBegin();
+    Record* rec = trackRemove(ptr);
+    if (NULL == rec) {
+        freeEnd(ts);
+#ifdef FLLOC_PRELOAD
+        sysFree(ptr);
+        return;
+#else
+        fprintf(stderr, "FLLOC FATAL: Unknown pointer %p when deleting "
+                "memory\n", ptr);
+        abort();
+#endif
+    }
+    checkKind(rec, kind);
+
+    // NB: The record is needed anyway to untrack the block, so the size given
+    // to a sized `operator delete` is only used to check it
+    if ((size != 0) && (size != rec->size)) {
+        char site[SITE_BUF_SIZE];
+        siteFormat(rec->site, site, sizeof(site));
+        fprintf(gFile, "FLLOC: Size mismatch: %p is %zu bytes, deleted as %zu "
+                "bytes; allocated from %s\n", ptr, rec->size, size, site);
+        atomic_store_explicit(&gAllGood, 0, memory_order_relaxed);
+    }
+    checkOnFree(rec);
+    traceEvent(FLLOC_TRACE_FREE, ptr, rec->size, rec->site);
+    releaseBlock(rec);
+    freeEnd(ts);
+}
+
+
+char* FllocStrdup(const char* s, const char* file, int line)
+{
+    if (NULL == s) {
+        fprintf(stderr, "FLLOC FATAL: strdup() called with NULL argument\n");
+        abort();
+    }
+    size_t size = strlen(s);
+    initIfNeeded();
+    char* str = allocPublic(size + 1, file, line, NULL);
+    if (str != NULL) {
+        strcpy(str, s);
+    }
+    return str;
+}
+
+
+char* FllocStrndup(const char* s, size_t n, const char* file, int line)
+{
+    if ((NULL == s) && (n > 0)) {
+        fprintf(stderr, "FLLOC FATAL: strndup() called with NULL argument "
+                "and >0 length\n");
+        abort();
+    }
+    if ((s != NULL) && (strlen(s) < n)) {
+        n = strlen(s);
+    }
+    initIfNeeded();
+    char* str = allocPublic(n + 1, file, line, NULL);
+    if (str != NULL) {
+        strncpy(str, s, n);
+        str[n] = '\0';
+    }
+    return str;
+}
+
+
+void* FllocAlignedAlloc(size_t align, size_t size, const char* file, int line)
+{
+    if ((0 == align) || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    initIfNeeded();
+    return alignedPublic(align, size, file, line, NULL);
+}
+
+
+int FllocPosixMemalign(void** memptr, size_t align, size_t size,
+        const char* file, int line)
+{
+    if ((align < sizeof(void*)) || (align & (align - 1))) {
+        return EINVAL;
+    }
+    initIfNeeded();
+    void* ptr = alignedPublic(align, size, file, line, NULL);
+    if ((NULL == ptr) && (size > 0)) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+
+void* FllocMemalign(size_t align, size_t size, const char* file, int line)
+{
+    align = alignRoundUp(align);
+    if (0 == align) {
+        errno = EINVAL;
+        return NULL;
+    }
+    initIfNeeded();
+    return alignedPublic(align, size, file, line, NULL);
+}
+
+
+
+/*----------------------------------+
+ | Private function implementations |
+ +----------------------------------*/
+
+
+static inline size_t ptrHash(void* ptr)
+{
+    // Finaliser of MurmurHash3
+    uint64_t h = (uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+static inline unsigned ptr2shard(void* ptr)
+{
+    return (ptrHash(ptr) >> 48) & (gShardCount - 1);
+}
+
+
+/** Maximum number of bytes a block takes on top of its size, to check sizes
+ * don't overflow
+ *
+ * @param align [in] Alignment of the block; at most `SIZE_MAX / 2 + 1`
+ */
+static inline size_t blockOverhead(size_t align)
+{
+    // Front padding, guards, and rounding to pages plus a protected page
+    return align + gFrontSize_B + gGuardSize_B + (2 * gPageSize_B);
+}
+
+
+static inline size_t frontGuardSize(const Record* rec)
+{
+    if (rec->flags & FLAG_PAGEGUARD) {
+        return 0;
+    }
+    return gFrontGuard_B;
+}
+
+
+static inline size_t backGuardSize(const Record* rec)
+{
+    if (rec->flags & FLAG_PAGEGUARD) {
+        if (gPageUnderflow) {
+            return 0;
+        }
+        // Slack between the end of the block and the protected page
+        return (rec->real + rec->mapSize - gPageSize_B)
+            - (rec->ptr + rec->size);
+    }
+    return gGuardSize_B;
+}
+
+
+static void recordInsert(Record* rec)
+{
+    if (gHeader) {
+        headerInsert(rec);
+        return;
+    }
+    if (gLfSlots != NULL) {
+        lfInsert(rec);
+        return;
+    }
+    Shard* shard = &(gShards[ptr2shard(rec->ptr)]);
+    pthread_mutex_lock(&shard->mutex);
+    tableInsert(shard, rec);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+
+static Record* recordRemove(void* ptr)
+{
+    if (gHeader) {
+        return headerRemove(ptr);
+    }
+    if (gLfSlots != NULL) {
+        return lfRemove(ptr);
+    }
+    Shard* shard = &(gShards[ptr2shard(ptr)]);
+    pthread_mutex_lock(&shard->mutex);
+    Record* rec = tableRemove(shard, ptr);
+    pthread_mutex_unlock(&shard->mutex);
+    return rec;
+}
+
+
+static void recordInsertBatch(Record** recs, unsigned count)
+{
+    unsigned i;
+    if (gLfSlots != NULL) {
+        for (i = 0; i < count; i++) {
+            lfInsert(recs[i]);
+        }
+        return;
+    }
+
+    // Sort the records by shard (counting sort, as there are few shards), so
+    // we can insert them shard by shard
+    unsigned shards[MAX_CACHE];
+    unsigned starts[MAX_SHARDS + 1];
+    Record* sorted[MAX_CACHE];
+    memset(starts, 0, (gShardCount + 1) * sizeof(starts[0]));
+    for (i = 0; i < count; i++) {
+        shards[i] = ptr2shard(recs[i]->ptr);
+        starts[shards[i] + 1]++;
+    }
+    unsigned s;
+    for (s = 0; s < gShardCount; s++) {
+        starts[s + 1] += starts[s];
+    }
+    for (i = 0; i < count; i++) {
+        sorted[starts[shards[i]]] = recs[i];
+        starts[shards[i]]++;
+    }
+
+    // NB: `starts[s]` is now the end of the records of shard `s`
+    i = 0;
+    for (s = 0; s < gShardCount; s++) {
+        if (i == starts[s]) {
+            continue;
+        }
+        Shard* shard = &(gShards[s]);
+        pthread_mutex_lock(&shard->mutex);
+        do {
+            tableInsert(shard, sorted[i]);
+            i++;
+        } while (i < starts[s]);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+
+static void tableInsert(Shard* shard, Record* rec)
+{
+    if (NULL == shard->slots) {
+        shard->slots = tableAlloc(TABLE_INITIAL_SLOTS);
+        shard->mask = TABLE_INITIAL_SLOTS - 1;
+        shard->count = 0;
+    } else if ((shard->count + 1) > (((shard->mask + 1) / 8) * 7)) {
+        tableGrow(shard);
+    }
+
+    // Robin Hood: take the slot of any record which is closer to its home
+    // than we are to ours, and carry on with that record instead
+    Slot curr = { rec->ptr, rec };
+    size_t mask = shard->mask;
+    size_t pos = ptrHash(curr.key) & mask;
+    size_t dist = 0;
+    for (;;) {
+        Slot* slot = &(shard->slots[pos]);
+        if (NULL == slot->key) {
+            *slot = curr;
+            shard->count++;
+            break;
+        }
+        size_t d = (pos - ptrHash(slot->key)) & mask;
+        if (d < dist) {
+            Slot tmp = *slot;
+            *slot = curr;
+            curr = tmp;
+            dist = d;
+        }
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+    tableMigrate(shard, MIGRATE_STEP);
+}
+
+
+static Record* tableRemove(Shard* shard, void* ptr)
+{
+    if (NULL == shard->slots) {
+        return NULL;
+    }
+    tableMigrate(shard, MIGRATE_STEP);
+
+    size_t pos;
+    if (slotFind(shard->slots, shard->mask, ptr, &pos)) {
+        size_t mask = shard->mask;
+        Record* rec = shard->slots[pos].rec;
+
+        // Shift back the following records until one is at its home slot
+        size_t next = (pos + 1) & mask;
+        while ((shard->slots[next].key != NULL)
+                && (((next - ptrHash(shard->slots[next].key)) & mask) > 0)) {
+            shard->slots[pos] = shard->slots[next];
+            pos = next;
+            next = (next + 1) & mask;
+        }
+        shard->slots[pos].key = NULL;
+        shard->slots[pos].rec = NULL;
+        shard->count--;
+        return rec;
+    }
+
+    if ((shard->oldSlots != NULL)
+            && slotFind(shard->oldSlots, shard->oldMask, ptr, &pos)) {
+        // NB: Keep the key, so searching the old table still works
+        Record* rec = shard->oldSlots[pos].rec;
+        shard->oldSlots[pos].rec = NULL;
+        return rec;
+    }
+    return NULL;
+}
+
+
+static int slotFind(Slot* slots, size_t mask, void* ptr, size_t* pos)
+{
+    size_t p = ptrHash(ptr) & mask;
+    size_t dist = 0;
+    for (;;) {
+        Slot* slot = &(slots[p]);
+        if (NULL == slot->key) {
+            return 0;
+        }
+        if (slot->key == ptr) {
+            // NB: A record moved from the old table has its key still there
+            if (NULL == slot->rec) {
+                return 0;
+            }
+            *pos = p;
+            return 1;
+        }
+        if (((p - ptrHash(slot->key)) & mask) < dist) {
+            // Our key would have taken this slot if it were in the table
+            return 0;
+        }
+        p = (p + 1) & mask;
+        dist++;
+    }
+}
+
+
+static void tableGrow(Shard* shard)
+{
+    if (shard->oldSlots != NULL) {
+        // This can't really happen, because the new table has room for more
+        // insertions than it takes to migrate the old table
+        tableMigrate(shard, shard->oldMask + 1);
+    }
+    shard->oldSlots = shard->slots;
+    shard->oldMask = shard->mask;
+    shard->migrated = 0;
+    shard->slots = tableAlloc(2 * (shard->mask + 1));
+    shard->mask = (2 * (shard->mask + 1)) - 1;
+    shard->count = 0;
+}
+
+
+static void tableMigrate(Shard* shard, size_t count)
+{
+    if (NULL == shard->oldSlots) {
+        return;
+    }
+    size_t oldCount = shard->oldMask + 1;
+    size_t end = shard->migrated + count;
+    if (end > oldCount) {
+        end = oldCount;
+    }
+
+    // NB: `tableInsert()` calls us back, but by then the old table is
+    // temporarily out of the way
+    Slot* old = shard->oldSlots;
+    shard->oldSlots = NULL;
+    size_t i;
+    for (i = shard->migrated; i < end; i++) {
+        if (old[i].rec != NULL) {
+            tableInsert(shard, old[i].rec);
+            old[i].rec = NULL;
+        }
+    }
+    shard->migrated = end;
+    if (end < oldCount) {
+        shard->oldSlots = old;
+    } else {
+        munmap(old, oldCount * sizeof(Slot));
+    }
+}
+
+
+static Slot* tableAlloc(size_t count)
+{
+    // NB: mmap() gives us zeroed pages, i.e. empty slots
+    Slot* slots = mmap(NULL, count * sizeof(Slot), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == slots) {
+        fprintf(stderr, "FLLOC FATAL: Failed to allocate hash table\n");
+        abort();
+    }
+    return slots;
+}
+
+
+static void headerInsert(Record* rec)
+{
+    HeaderRecord* hdr = (HeaderRecord*)rec;
+    hdr->magic = HEADER_MAGIC;
+    Shard* shard = &(gShards[ptr2shard(rec->ptr)]);
+    pthread_mutex_lock(&shard->mutex);
+    hdr->prev = NULL;
+    hdr->next = shard->records;
+    if (hdr->next != NULL) {
+        headerCheck(hdr->next);
+        hdr->next->prev = hdr;
+        hdr->next->checksum = headerChecksum(hdr->next);
+    }
+    hdr->checksum = headerChecksum(hdr);
+    shard->records = hdr;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+
+static Record* headerRemove(void* ptr)
+{
+    HeaderRecord* hdr = ptr - gFrontSize_B;
+    if ((hdr->magic != HEADER_MAGIC) || (hdr->rec.ptr != ptr)) {
+        fprintf(stderr, "FLLOC FATAL: Unknown pointer %p or corrupted block "
+                "header\n", ptr);
+        abort();
+    }
+    Shard* shard = &(gShards[ptr2shard(ptr)]);
+    pthread_mutex_lock(&shard->mutex);
+    // NB: The links, hence the checksum, may change until the mutex is held
+    if (hdr->checksum != headerChecksum(hdr)) {
+        fprintf(stderr, "FLLOC FATAL: Unknown pointer %p or corrupted block "
+                "header\n", ptr);
+        abort();
+    }
+    if (hdr->prev != NULL) {
+        headerCheck(hdr->prev);
+        hdr->prev->next = hdr->next;
+        hdr->prev->checksum = headerChecksum(hdr->prev);
+    } else {
+        shard->records = hdr->next;
+    }
+    if (hdr->next != NULL) {
+        headerCheck(hdr->next);
+        hdr->next->prev = hdr->prev;
+        hdr->next->checksum = headerChecksum(hdr->next);
+    }
+    if (shard->scrubCursor == hdr) {
+        shard->scrubCursor = hdr->next;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    hdr->magic = 0; // to catch double frees
+    return &hdr->rec;
+}
+
+
+static uint64_t headerChecksum(const HeaderRecord* hdr)
+{
+    const Record* rec = &hdr->rec;
+    uint64_t h = ptrHash(rec->ptr);
+    h = ptrHash((void*)(h ^ (uintptr_t)rec->real));
+    h = ptrHash((void*)(h ^ (uintptr_t)hdr->next));
+    h = ptrHash((void*)(h ^ (uintptr_t)hdr->prev));
+    h = ptrHash((void*)(h ^ rec->size));
+    h = ptrHash((void*)(h ^ rec->mapSize));
+    h = ptrHash((void*)(h ^ rec->site));
+    h = ptrHash((void*)(h ^ rec->stack));
+    h = ptrHash((void*)(h ^ (rec->flags & ~FLAG_REPORTED)));
+    return h ^ hdr->magic;
+}
+
+
+static void headerCheck(const HeaderRecord* hdr)
+{
+    if ((hdr->magic != HEADER_MAGIC) || (hdr->checksum != headerChecksum(hdr))) {
+        fprintf(stderr, "FLLOC FATAL: Corrupted block header at %p\n",
+                (void*)hdr);
+        abort();
+    }
+}
+
+
+static void lfInsert(Record* rec)
+{
+    size_t h = ptrHash(rec->ptr);
+    size_t i;
+    for (i = 0; i <= gLfMask; i++) {
+        LfSlot* slot = &(gLfSlots[(h + i) & gLfMask]);
+        uintptr_t key = atomic_load_explicit(&slot->key, memory_order_relaxed);
+        if ((key != LF_EMPTY) && (key != LF_TOMBSTONE)) {
+            continue;
+        }
+        // NB: Raise the bound before claiming the slot, so a lookup never
+        // stops short of a key
+        size_t max = atomic_load_explicit(&gLfProbeMax, memory_order_relaxed);
+        while ((max < i) && !atomic_compare_exchange_weak_explicit(
+                    &gLfProbeMax, &max, i, memory_order_acq_rel,
+                    memory_order_relaxed)) {
+        }
+        if (atomic_compare_exchange_strong_explicit(&slot->key, &key,
+                    (uintptr_t)rec->ptr, memory_order_acq_rel,
+                    memory_order_relaxed)) {
+            atomic_store_explicit(&slot->rec, rec, memory_order_release);
+            return;
+        }
+    }
+    fprintf(stderr, "FLLOC FATAL: Lock-free table is full; "
+            "increase LOCKFREE\n");
+    abort();
+}
+
+
+static Record* lfRemove(void* ptr)
+{
+    // NB: Only the owner of a block frees it, so nobody else can be removing
+    // this key concurrently
+    LfSlot* slot = lfSlotFind(ptr);
+    if (NULL == slot) {
+        return NULL;
+    }
+    Record* rec = atomic_load_explicit(&slot->rec, memory_order_relaxed);
+    atomic_store_explicit(&slot->rec, NULL, memory_order_relaxed);
+    atomic_store_explicit(&slot->key, LF_TOMBSTONE, memory_order_release);
+    return rec;
+}
+
+
+static LfSlot* lfSlotFind(void* ptr)
+{
+    size_t h = ptrHash(ptr);
+    size_t max = atomic_load_explicit(&gLfProbeMax, memory_order_acquire);
+    size_t i;
+    for (i = 0; i <= max; i++) {
+        LfSlot* slot = &(gLfSlots[(h + i) & gLfMask]);
+        uintptr_t key = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (LF_EMPTY == key) {
+            break;
+        }
+        if (key == (uintptr_t)ptr) {
+            // NB: The key is claimed before the record is stored, so the
+            // thread inserting it (e.g. flushing its cache) may not have
+            // stored the record yet
+            while (NULL == atomic_load_explicit(&slot->rec,
+                        memory_order_acquire)) {
+                sched_yield();
+            }
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+
+static void trackInsert(Record* rec)
+{
+    ThreadState* ts = (gCacheSize > 0) ? threadState() : NULL;
+    if (NULL == ts) {
+        recordInsert(rec);
+        return;
+    }
+    pthread_mutex_lock(&ts->mutex);
+    if (ts->count >= gCacheSize) {
+        cacheFlush(ts);
+    }
+    cachePut(ts, rec);
+    pthread_mutex_unlock(&ts->mutex);
+}
+
+
+static Record* trackRemove(void* ptr)
+{
+    ThreadState* ts = (gCacheSize > 0) ? threadState() : NULL;
+    if (ts != NULL) {
+        pthread_mutex_lock(&ts->mutex);
+        Record* rec = cacheLookup(ts, ptr, 1);
+        pthread_mutex_unlock(&ts->mutex);
+        if (rec != NULL) {
+            return rec;
+        }
+    }
+
+    Record* rec = recordRemove(ptr);
+    if ((NULL == rec) && (gCacheSize > 0)) {
+        // The block might have been allocated by another thread which didn't
+        // publish it yet, or which published it since we looked
+        rec = cacheLookupAll(ptr, 1);
+        if (NULL == rec) {
+            rec = recordRemove(ptr);
+        }
+    }
+    return rec;
+}
+
+
+#ifdef FLLOC_PRELOAD
+
+static Record* trackFind(void* ptr)
+{
+    ThreadState* ts = (gCacheSize > 0) ? threadState() : NULL;
+    if (ts != NULL) {
+        pthread_mutex_lock(&ts->mutex);
+        Record* rec = cacheLookup(ts, ptr, 0);
+        pthread_mutex_unlock(&ts->mutex);
+        if (rec != NULL) {
+            return rec;
+        }
+    }
+
+    Record* rec = recordFind(ptr);
+    if ((NULL == rec) && (gCacheSize > 0)) {
+        // The block might have been allocated by another thread which didn't
+        // publish it yet, or which published it since we looked
+        rec = cacheLookupAll(ptr, 0);
+        if (NULL == rec) {
+            rec = recordFind(ptr);
+        }
+    }
+    return rec;
+}
+
+
+static Record* recordFind(void* ptr)
+{
+    // NB: `HEADER` is ignored in preload mode
+    if (gLfSlots != NULL) {
+        LfSlot* slot = lfSlotFind(ptr);
+        return (NULL == slot) ? NULL
+            : atomic_load_explicit(&slot->rec, memory_order_relaxed);
+    }
+    Shard* shard = &(gShards[ptr2shard(ptr)]);
+    Record* rec = NULL;
+    size_t pos;
+    pthread_mutex_lock(&shard->mutex);
+    if ((shard->slots != NULL)
+            && slotFind(shard->slots, shard->mask, ptr, &pos)) {
+        rec = shard->slots[pos].rec;
+    } else if ((shard->oldSlots != NULL)
+            && slotFind(shard->oldSlots, shard->oldMask, ptr, &pos)) {
+        rec = shard->oldSlots[pos].rec;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return rec;
+}
+
+#endif
+
+
+static ThreadState* freeBegin(void)
+{
+    if (NULL == gLfSlots) {
+        return NULL;
+    }
+    ThreadState* ts = threadState();
+    for (;;) {
+        // NB: This and `lfPauseFrees()` each set their flag before checking
+        // the other one's, so at least one of them sees the other
+        if (ts != NULL) {
+            atomic_store(&ts->freeing, 1);
+        } else {
+            atomic_fetch_add(&gLfFreeing, 1);
+        }
+        if (!atomic_load(&gLfPaused)) {
+            return ts;
+        }
+        freeEnd(ts);
+        pthread_mutex_lock(&gLfPauseMutex);
+        pthread_mutex_unlock(&gLfPauseMutex);
+    }
+}
+
+
+static void freeEnd(ThreadState* ts)
+{
+    if (NULL == gLfSlots) {
+        return;
+    }
+    if (ts != NULL) {
+        atomic_store_explicit(&ts->freeing, 0, memory_order_release);
+    } else {
+        atomic_fetch_sub_explicit(&gLfFreeing, 1, memory_order_release);
+    }
+}
+
+
+static void lfPauseFrees(void)
+{
+    pthread_mutex_lock(&gLfPauseMutex);
+    atomic_store(&gLfPaused, 1);
+    // NB: Don't keep `gThreadsMutex` while waiting, as a thread freeing a
+    // block may need it to flush the thread caches
+    int busy;
+    do {
+        busy = (atomic_load(&gLfFreeing) > 0);
+        pthread_mutex_lock(&gThreadsMutex);
+        ThreadState* ts;
+        for (ts = gThreads; (ts != NULL) && !busy; ts = ts->next) {
+            busy = atomic_load(&ts->freeing);
+        }
+        pthread_mutex_unlock(&gThreadsMutex);
+        if (busy) {
+            sched_yield();
+        }
+    } while (busy);
+}
+
+
+static void lfResumeFrees(void)
+{
+    atomic_store(&gLfPaused, 0);
+    pthread_mutex_unlock(&gLfPauseMutex);
+}
+
+
+static Record* recordAlloc(void)
+{
+    Record* rec;
+    ThreadState* ts = threadState();
+    if (NULL == ts) {
+        rec = NULL;
+        slabGet(&rec, 1);
+        return rec;
+    }
+    if (NULL == ts->freeRecords) {
+        ts->freeCount = slabGet(&ts->freeRecords, SLAB_BATCH);
+    }
+    rec = ts->freeRecords;
+    ts->freeRecords = rec->nextFree;
+    ts->freeCount--;
+    return rec;
+}
+
+
+static void recordFree(Record* rec)
+{
+    ThreadState* ts = threadState();
+    if (NULL == ts) {
+        rec->nextFree = NULL;
+        slabPut(&rec, 1);
+        return;
+    }
+    rec->nextFree = ts->freeRecords;
+    ts->freeRecords = rec;
+    ts->freeCount++;
+    if (ts->freeCount >= (2 * SLAB_BATCH)) {
+        slabPut(&ts->freeRecords, SLAB_BATCH);
+        ts->freeCount -= SLAB_BATCH;
+    }
+}
+
+
+static unsigned slabGet(Record** list, unsigned count)
+{
+    unsigned n;
+    pthread_mutex_lock(&gSlabMutex);
+    for (n = 0; n < count; n++) {
+        Record* rec = gFreeRecords;
+        if (rec != NULL) {
+            gFreeRecords = rec->nextFree;
+        } else {
+            if (gSlabPos + sizeof(Record) > gSlabEnd) {
+                gSlabPos = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (MAP_FAILED == gSlabPos) {
+                    fprintf(stderr, "FLLOC FATAL: Failed to allocate memory "
+                            "for records\n");
+                    abort();
+                }
+                gSlabEnd = gSlabPos + SLAB_CHUNK_SIZE;
+            }
+            rec = gSlabPos;
+            gSlabPos += sizeof(Record);
+        }
+        rec->nextFree = *list;
+        *list = rec;
+    }
+    pthread_mutex_unlock(&gSlabMutex);
+    return n;
+}
+
+
+static void slabPut(Record** list, unsigned count)
+{
+    pthread_mutex_lock(&gSlabMutex);
+    unsigned n;
+    for (n = 0; (n < count) && (*list != NULL); n++) {
+        Record* rec = *list;
+        *list = rec->nextFree;
+        rec->nextFree = gFreeRecords;
+        gFreeRecords = rec;
+    }
+    pthread_mutex_unlock(&gSlabMutex);
+}
+
+
+static ThreadState* threadState(void)
+{
+    ThreadState* ts = &tThread;
+    if (ts->exited) {
+        return NULL;
+    }
+    if (!ts->registered) {
+        pthread_mutex_init(&ts->mutex, NULL);
+        ts->count = 0;
+        pthread_mutex_lock(&gThreadsMutex);
+        ts->next = gThreads;
+        gThreads = ts;
+        pthread_mutex_unlock(&gThreadsMutex);
+        ts->registered = 1;
+        pthread_setspecific(gThreadKey, ts);
+    }
+    return ts;
+}
+
+
+static void cachePut(ThreadState* ts, Record* rec)
+{
+    size_t pos = ptrHash(rec->ptr) & gCacheMask;
+    while (ts->pending[pos].key != NULL) {
+        pos = (pos + 1) & gCacheMask;
+    }
+    ts->pending[pos].key = rec->ptr;
+    ts->pending[pos].rec = rec;
+    ts->count++;
+}
+
+
+static Record* cacheLookup(ThreadState* ts, void* ptr, int remove)
+{
+    CacheSlot* slots = ts->pending;
+    size_t pos = ptrHash(ptr) & gCacheMask;
+    for (;;) {
+        if (NULL == slots[pos].key) {
+            return NULL;
+        }
+        if (slots[pos].key == ptr) {
+            break;
+        }
+        pos = (pos + 1) & gCacheMask;
+    }
+    Record* rec = slots[pos].rec;
+    if (!remove) {
+        return rec;
+    }
+
+    // Move back the following records which would not be found any more,
+    // i.e. those whose home slot is not after the hole
+    size_t next = pos;
+    for (;;) {
+        next = (next + 1) & gCacheMask;
+        void* key = slots[next].key;
+        if (NULL == key) {
+            break;
+        }
+        size_t home = ptrHash(key) & gCacheMask;
+        if (((next - home) & gCacheMask) >= ((next - pos) & gCacheMask)) {
+            slots[pos] = slots[next];
+            pos = next;
+        }
+    }
+    slots[pos].key = NULL;
+    slots[pos].rec = NULL;
+    ts->count--;
+    return rec;
+}
+
+
+static Record* cacheLookupAll(void* ptr, int remove)
+{
+    Record* rec = NULL;
+    pthread_mutex_lock(&gThreadsMutex);
+    ThreadState* ts;
+    for (ts = gThreads; (ts != NULL) && (NULL == rec); ts = ts->next) {
+        pthread_mutex_lock(&ts->mutex);
+        rec = cacheLookup(ts, ptr, remove);
+        pthread_mutex_unlock(&ts->mutex);
+    }
+    pthread_mutex_unlock(&gThreadsMutex);
+    return rec;
+}
+
+
+static void cacheFlush(ThreadState* ts)
+{
+    Record* recs[MAX_CACHE];
+    unsigned count = 0;
+    size_t pos;
+    for (pos = 0; count < ts->count; pos++) {
+        CacheSlot* slot = &(ts->pending[pos]);
+        if (slot->key != NULL) {
+            recs[count] = slot->rec;
+            count++;
+            slot->key = NULL;
+            slot->rec = NULL;
+        }
+    }
+    recordInsertBatch(recs, count);
+    ts->count = 0;
+}
+
+
+static void cacheFlushAll(void)
+{
+    pthread_mutex_lock(&gThreadsMutex);
+    ThreadState* ts;
+    for (ts = gThreads; ts != NULL; ts = ts->next) {
+        pthread_mutex_lock(&ts->mutex);
+        cacheFlush(ts);
+        pthread_mutex_unlock(&ts->mutex);
+    }
+    pthread_mutex_unlock(&gThreadsMutex);
+}
+
+
+static void threadExit(void* arg)
+{
+    ThreadState* ts = arg;
+
+    // Publish the pending records before unregistering the thread, so other
+    // threads freeing them always find them. NB: Any block allocated from now
+    // on by this thread (e.g. by other thread-specific data destructors) goes
+    // straight into the table.
+    pthread_mutex_lock(&ts->mutex);
+    ts->exited = 1;
+    cacheFlush(ts);
+    pthread_mutex_unlock(&ts->mutex);
+
+    // Unregister the thread; its state will disappear with it
+    pthread_mutex_lock(&gThreadsMutex);
+    ThreadState** curr = &gThreads;
+    while (*curr != ts) {
+        curr = &((*curr)->next);
+    }
+    *curr = ts->next;
+    pthread_mutex_unlock(&gThreadsMutex);
+
+    if (ts->trace != NULL) {
+        // The trace writer hands it over to another thread once drained
+        atomic_store_explicit(&ts->trace->state, RING_EXITED,
+                memory_order_release);
+        ts->trace = NULL;
+    }
+    pthread_mutex_destroy(&ts->mutex);
+    slabPut(&ts->freeRecords, ts->freeCount);
+    ts->freeCount = 0;
+}
+
+
+static void initIfNeeded(void)
+{
+    if (atomic_load_explicit(&gInitialised, memory_order_acquire)) {
+        return;
+    }
+    pthread_mutex_lock(&gMutex);
+    if (!atomic_load_explicit(&gInitialised, memory_order_relaxed)) {
+        doInit();
+        atomic_store_explicit(&gInitialised, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&gMutex);
+}
+
+
+static void doInit(void)
+{
+    gFile = stderr;
+
+    gGuardScan = guardScanWord;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gGuardScan = guardScanAvx2;
+    } else {
+        gGuardScan = guardScanSse2; // all x86_64 CPUs have SSE2
+    }
+#endif
+
+
+    const char* str = getenv("FLLOC_CONFIG");
+    if (str != NULL) {
+        size_t len = strlen(str);
+        char* s = sysMalloc(len + 1);
+        if (NULL == s) {
+            fprintf(stderr, "FLLOC FATAL: critical malloc() failed\n");
+            abort();
+        }
+        memcpy(s, str, len + 1);
+        char* saveptr;
+        char* token = strtok_r(s, ";", &saveptr);
+        while (token != NULL) {
+            char* saveptr2;
+            char* name = strtok_r(token, "=", &saveptr2);
+            char* value = strtok_r(NULL, "=", &saveptr2);
+            if ((name != NULL) && (value != NULL)) {
+                parseConfig(name, value);
+            }
+            token = strtok_r(NULL, ";", &saveptr);
+        }
+        sysFree(s);
+    }
+
+    unsigned i;
+    for (i = 0; i < gShardCount; i++) {
+        pthread_mutex_init(&(gShards[i].mutex), NULL);
+    }
+    if ((gSampleMean > 0) && (gGuardSize_B < SAMPLE_TAG_SIZE)) {
+        // Telling untracked blocks apart reads the 16 bytes in front of the
+        // user pointer, which must then be readable for tracked blocks too
+        fprintf(stderr, "FLLOC WARNING: GUARD is raised to %d with SAMPLE\n",
+                SAMPLE_TAG_SIZE);
+        gGuardSize_B = SAMPLE_TAG_SIZE;
+    }
+    if ((gSampleMean > 0) && gPageUnderflow) {
+        fprintf(stderr, "FLLOC WARNING: PAGESIDE=underflow is ignored with "
+                "SAMPLE\n");
+        gPageUnderflow = 0;
+    }
+#ifdef FLLOC_PRELOAD
+    if (gHeader) {
+        // NB: Header mode reads memory in front of the pointers being freed,
+        // which may not belong to us
+        fprintf(stderr, "FLLOC WARNING: HEADER is ignored in preload mode\n");
+        gHeader = 0;
+    }
+#endif
+    size_t headerSize = 0;
+    if (gHeader) {
+        if ((gLfMask > 0) || (gCacheSize > 0)) {
+            fprintf(stderr, "FLLOC WARNING: LOCKFREE and CACHE are ignored "
+                    "in header mode\n");
+            gLfMask = 0;
+            gCacheSize = 0;
+        }
+        headerSize = HEADER_SIZE;
+        if (gPageUnderflow) {
+            fprintf(stderr, "FLLOC WARNING: PAGESIDE=underflow is ignored "
+                    "in header mode\n");
+            gPageUnderflow = 0;
+        }
+    }
+    if (gAlign_B < NATURAL_ALIGN) {
+        gAlign_B = NATURAL_ALIGN;
+    }
+    gFrontSize_B = (headerSize + gGuardSize_B + gAlign_B - 1) & ~(gAlign_B - 1);
+    gFrontGuard_B = gFrontSize_B - headerSize;
+    gUntrackedFront_B = (gAlign_B > SAMPLE_TAG_SIZE) ? gAlign_B
+        : SAMPLE_TAG_SIZE;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize > 0) {
+        gPageSize_B = pageSize;
+    }
+    if (gStackDepth > 0) {
+        gStackFrames = mmap(NULL,
+                (size_t)MAX_STACKS * gStackDepth * sizeof(*gStackFrames),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        gStackSizes = mmap(NULL, MAX_STACKS * sizeof(*gStackSizes),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        gStackIndex = mmap(NULL, 2 * MAX_STACKS * sizeof(*gStackIndex),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if ((MAP_FAILED == gStackFrames) || (MAP_FAILED == gStackSizes)
+                || (MAP_FAILED == gStackIndex)) {
+            fprintf(stderr, "FLLOC FATAL: Failed to allocate stack table\n");
+            abort();
+        }
+    }
+    if (pthread_key_create(&gThreadKey, threadExit) != 0) {
+        fprintf(stderr, "FLLOC FATAL: Failed to create thread key\n");
+        abort();
+    }
+    if (gLfMask > 0) {
+        // NB: mmap() gives us zeroed pages, i.e. EMPTY slots, on demand
+        gLfSlots = mmap(NULL, (gLfMask + 1) * sizeof(LfSlot),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == gLfSlots) {
+            fprintf(stderr, "FLLOC FATAL: Failed to allocate lock-free "
+                    "table\n");
+            abort();
+        }
+    }
+    if (gScrubRate > 0) {
+        if (gLfSlots != NULL) {
+            fprintf(stderr, "FLLOC WARNING: SCRUB is ignored with LOCKFREE\n");
+        } else {
+            if (!gCheckSet) {
+                // The scrubbing thread does most of the checking, so only do
+                // a cheap check when freeing blocks
+                gCheckPolicy = CHECK_EDGE;
+                gCheckParam = 16;
+            }
+            pthread_t thread;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &attr, scrubThread, NULL) != 0) {
+                fprintf(stderr, "FLLOC FATAL: Failed to create scrubbing "
+                        "thread\n");
+                abort();
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    if (gTraceFd >= 0) {
+        // NB: The header is written again at exit with the final counters
+        traceWrite(&gTraceHeader, sizeof(gTraceHeader));
+        if (pthread_create(&gTraceThread, NULL, traceThread, NULL) != 0) {
+            fprintf(stderr, "FLLOC FATAL: Failed to create trace writer "
+                    "thread\n");
+            abort();
+        }
+    }
+    atexit(fllocCheck);
+}
+
+
+static void parseConfig(const char* name, const char* value)
+{
+    if (strcmp(name, "FILE") == 0) {
+        if ((gFile != NULL) && (gFile != stderr)) {
+            fclose(gFile);
+        }
+        gFile = fopen(value, "w");
+        if (NULL == gFile) {
+            fprintf(stderr, "FLLOC FATAL: Can't open '%s' for writing\n",
+                    value);
+            abort();
+        }
+
+    } else if (strcmp(name, "GUARD") == 0) {
+        unsigned long tmp;
+        if (sscanf(value, "%lu", &tmp) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid GUARD value '%s'\n", value);
+            abort();
+        }
+        gGuardSize_B = tmp;
+
+    } else if (strcmp(name, "CHECK") == 0) {
+        unsigned long tmp;
+        double ratio;
+        if (strcmp(value, "all") == 0) {
+            gCheckPolicy = CHECK_ALL;
+        } else if ((sscanf(value, "every:%lu", &tmp) == 1) && (tmp > 0)) {
+            gCheckPolicy = CHECK_EVERY;
+            gCheckParam = tmp;
+        } else if ((sscanf(value, "random:%lf", &ratio) == 1)
+                && (ratio >= 0.0) && (ratio <= 1.0)) {
+            gCheckPolicy = CHECK_RANDOM;
+            gCheckParam = ratio * 4294967296.0;
+        } else if (sscanf(value, "edge:%lu", &tmp) == 1) {
+            gCheckPolicy = CHECK_EDGE;
+            gCheckParam = tmp;
+        } else {
+            fprintf(stderr, "FLLOC FATAL: Invalid CHECK value '%s'\n", value);
+            abort();
+        }
+        gCheckSet = 1;
+
+    } else if (strcmp(name, "PAGEGUARD") == 0) {
+        unsigned long tmp;
+        if (sscanf(value, "%lu", &tmp) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid PAGEGUARD value '%s'\n",
+                    value);
+            abort();
+        }
+        gPageGuard_B = tmp;
+
+    } else if (strcmp(name, "MMAP") == 0) {
+        unsigned long tmp;
+        if (sscanf(value, "%lu", &tmp) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid MMAP value '%s'\n", value);
+            abort();
+        }
+        gMmap_B = tmp;
+
+    } else if (strcmp(name, "GUARDSCAN") == 0) {
+        if (strcmp(value, "auto") == 0) {
+            // Already chosen by `doInit()`
+        } else if (strcmp(value, "word") == 0) {
+            gGuardScan = guardScanWord;
+#ifdef __x86_64__
+        } else if (strcmp(value, "sse2") == 0) {
+            gGuardScan = guardScanSse2;
+        } else if (strcmp(value, "avx2") == 0) {
+            if (__builtin_cpu_supports("avx2")) {
+                gGuardScan = guardScanAvx2;
+            } else {
+                fprintf(stderr, "FLLOC WARNING: This CPU does not support "
+                        "GUARDSCAN=avx2; ignored\n");
+            }
+#endif
+        } else {
+            fprintf(stderr, "FLLOC FATAL: Invalid GUARDSCAN value '%s'\n",
+                    value);
+            abort();
+        }
+
+    } else if (strcmp(name, "PAGESIDE") == 0) {
+        if (strcmp(value, "overflow") == 0) {
+            gPageUnderflow = 0;
+        } else if (strcmp(value, "underflow") == 0) {
+            gPageUnderflow = 1;
+        } else {
+            fprintf(stderr, "FLLOC FATAL: Invalid PAGESIDE value '%s'\n",
+                    value);
+            abort();
+        }
+
+    } else if (strcmp(name, "REPORT") == 0) {
+        if (strcmp(value, "blocks") == 0) {
+            gReportGrouped = 0;
+        } else if (strcmp(value, "grouped") == 0) {
+            gReportGrouped = 1;
+        } else {
+            fprintf(stderr, "FLLOC FATAL: Invalid REPORT value '%s'\n",
+                    value);
+            abort();
+        }
+
+    } else if (strcmp(name, "SAMPLE") == 0) {
+        if (sscanf(value, "%zu", &gSampleMean) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid SAMPLE value '%s'\n",
+                    value);
+            abort();
+        }
+
+    } else if (strcmp(name, "SCAN") == 0) {
+        if ((sscanf(value, "%u", &gScanThreads) != 1) || (gScanThreads < 1)
+                || (gScanThreads > MAX_SCAN_THREADS)) {
+            fprintf(stderr, "FLLOC FATAL: Invalid SCAN value '%s'; must be "
+                    "between 1 and %d\n", value, MAX_SCAN_THREADS);
+            abort();
+        }
+
+    } else if (strcmp(name, "STACK") == 0) {
+        if ((sscanf(value, "%u", &gStackDepth) != 1)
+                || (gStackDepth > MAX_STACK_DEPTH)) {
+            fprintf(stderr, "FLLOC FATAL: Invalid STACK value '%s'; must be "
+                    "between 0 and %d\n", value, MAX_STACK_DEPTH);
+            abort();
+        }
+
+    } else if (strcmp(name, "STATS") == 0) {
+        if (sscanf(value, "%d", &gStats) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid STATS value '%s'\n", value);
+            abort();
+        }
+
+    } else if (strcmp(name, "SCRUB") == 0) {
+        if (sscanf(value, "%lu", &gScrubRate) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid SCRUB value '%s'\n", value);
+            abort();
+        }
+
+    } else if (strcmp(name, "TRACE") == 0) {
+        if (gTraceFd >= 0) {
+            close(gTraceFd);
+            fclose(gTraceSites);
+        }
+        gTraceFd = open(value, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (gTraceFd < 0) {
+            fprintf(stderr, "FLLOC FATAL: Can't open '%s' for writing\n",
+                    value);
+            abort();
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.sites", value);
+        gTraceSites = fopen(path, "w");
+        if (NULL == gTraceSites) {
+            fprintf(stderr, "FLLOC FATAL: Can't open '%s' for writing\n",
+                    path);
+            abort();
+        }
+
+    } else if (strcmp(name, "SHARDS") == 0) {
+        unsigned long tmp;
+        if ((sscanf(value, "%lu", &tmp) != 1) || (0 == tmp)
+                || (tmp > MAX_SHARDS)) {
+            fprintf(stderr, "FLLOC FATAL: Invalid SHARDS value '%s' "
+                    "(must be between 1 and %d)\n", value, MAX_SHARDS);
+            abort();
+        }
+        // Round up to the next power of 2
+        gShardCount = 1;
+        while (gShardCount < tmp) {
+            gShardCount <<= 1;
+        }
+
+    } else if (strcmp(name, "ALIGN") == 0) {
+        unsigned long tmp;
+        if ((sscanf(value, "%lu", &tmp) != 1) || (0 == tmp)
+                || (tmp & (tmp - 1))) {
+            fprintf(stderr, "FLLOC FATAL: Invalid ALIGN value '%s' (must be "
+                    "a power of 2)\n", value);
+            abort();
+        }
+        gAlign_B = tmp;
+
+    } else if (strcmp(name, "HEADER") == 0) {
+        if (sscanf(value, "%d", &gHeader) != 1) {
+            fprintf(stderr, "FLLOC FATAL: Invalid HEADER value '%s'\n", value);
+            abort();
+        }
+
+    } else if (strcmp(name, "CACHE") == 0) {
+        unsigned long tmp;
+        if ((sscanf(value, "%lu", &tmp) != 1) || (tmp > MAX_CACHE)) {
+            fprintf(stderr, "FLLOC FATAL: Invalid CACHE value '%s' "
+                    "(must be between 0 and %d)\n", value, MAX_CACHE);
+            abort();
+        }
+        gCacheSize = tmp;
+        gCacheMask = 1;
+        while (gCacheMask < (2 * gCacheSize)) {
+            gCacheMask *= 2;
+        }
+        gCacheMask--;
+
+    } else if (strcmp(name, "LOCKFREE") == 0) {
+        unsigned long tmp;
+        if ((sscanf(value, "%lu", &tmp) != 1) || (tmp > (1UL << 40))) {
+            fprintf(stderr, "FLLOC FATAL: Invalid LOCKFREE value '%s'\n",
+                    value);
+            abort();
+        }
+        // Round up to the next power of 2; 0 disables the lock-free table
+        gLfMask = 0;
+        if (tmp > 0) {
+            size_t count = 2;
+            while (count < tmp) {
+                count <<= 1;
+            }
+            gLfMask = count - 1;
+        }
+
+    } else {
+        fprintf(stderr, "FLLOC WARNING: Unknown parameter '%s'; ignored\n",
+                name);
+    }
+}
+
+
+static void* doRealloc(void* old, size_t size, uint32_t site, uint32_t stack)
+{
+    if (0 == size) {
+        return NULL;
+    }
+
+    Record* oldRec = NULL;
+    uint32_t oldKind = 0;
+    if (old != NULL) {
+        oldRec = trackRemove(old);
+        if (NULL == oldRec) {
+#ifdef FLLOC_PRELOAD
+            // Allocated by the C library while we could not track it
+            return sysRealloc(old, size);
+#else
+            fprintf(stderr,
+                    "FLLOC FATAL: Unknown pointer %p when doing reallocation\n",
+                    old);
+            abort();
+#endif
+        }
+        checkKind(oldRec, FLLOC_KIND_MALLOC);
+        oldKind = oldRec->flags & FLAG_KIND_MASK;
+        oldRec->flags &= ~FLAG_KIND_MASK;
+        checkOnFree(oldRec);
+        uint32_t oldSite = oldRec->site;
+        size_t oldSize = oldRec->size;
+        Record* rec = resizeBlock(oldRec, size);
+        if (rec != NULL) {
+            siteFree(oldSite, oldSize);
+            siteAlloc(site, size);
+            rec->site = site;
+            rec->stack = stack;
+            trackInsert(rec);
+            traceEvent(FLLOC_TRACE_FREE, old, oldSize, oldSite);
+            traceEvent(FLLOC_TRACE_REALLOC, rec->ptr, size, site);
+            return rec->ptr;
+        }
+    }
+
+    Record* rec = allocBlock(size, 0, 0, site, stack);
+    if (NULL == rec) {
+        if (oldRec != NULL) {
+            // NB: `realloc(3)` leaves the original block untouched if it fails
+            oldRec->flags |= oldKind;
+            trackInsert(oldRec);
+        }
+        return NULL;
+    }
+    trackInsert(rec);
+
+    if (NULL == oldRec) {
+        traceEvent(FLLOC_TRACE_MALLOC, rec->ptr, size, site);
+    } else {
+        traceEvent(FLLOC_TRACE_FREE, old, oldRec->size, oldRec->site);
+        traceEvent(FLLOC_TRACE_REALLOC, rec->ptr, size, site);
+        memcpy(rec->ptr, old, (oldRec->size < size) ? oldRec->size : size);
+        releaseBlock(oldRec);
+    }
+    return rec->ptr;
+}
+
+
+static Record* resizeBlock(Record* rec, size_t size)
+{
+    if ((rec->flags & FLAG_PAGEGUARD)
+            || ((gPageGuard_B > 0) && (size >= gPageGuard_B))) {
+        return NULL;
+    }
+    size_t front = rec->ptr - rec->real;
+    if (size > (SIZE_MAX - (front + gGuardSize_B + gPageSize_B))) {
+        return NULL;
+    }
+    size_t needed = front + size + gGuardSize_B;
+
+    if (rec->flags & FLAG_MAPPED) {
+        if (size < gMmap_B) {
+            // Too small to deserve its own mapping any more
+            return NULL;
+        }
+        size_t pageMask = gPageSize_B - 1;
+        size_t mapSize = (needed + pageMask) & ~pageMask;
+        if (mapSize != rec->mapSize) {
+            // NB: This just moves pages around, the content is not copied
+            void* real = mremap(rec->real, rec->mapSize, mapSize,
+                    MREMAP_MAYMOVE);
+            if (MAP_FAILED == real) {
+                return NULL;
+            }
+            if (gHeader) {
+                rec = real + front - gFrontSize_B;
+            }
+            rec->real = real;
+            rec->ptr = real + front;
+            rec->mapSize = mapSize;
+        }
+
+    } else if (sysUsableSize(rec->real) < needed) {
+        return NULL;
+    }
+
+    rec->size = size;
+    memset(rec->ptr + size, FLLOC_FILL, backGuardSize(rec));
+    return rec;
+}
+
+
+static Record* allocBlock(size_t size, int zero, size_t align, uint32_t site,
+        uint32_t stack)
+{
+    if (align < gAlign_B) {
+        align = gAlign_B;
+    }
+    if (size > (SIZE_MAX - blockOverhead(align))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    Record* rec;
+    if ((gPageGuard_B > 0) && (size >= gPageGuard_B)
+            && (align <= gPageSize_B)) {
+        rec = allocPageGuarded(size, align);
+        if (NULL == rec) {
+            return NULL;
+        }
+    } else if ((gMmap_B > 0) && (size >= gMmap_B) && (align <= gPageSize_B)) {
+        rec = allocMapped(size, align);
+        if (NULL == rec) {
+            return NULL;
+        }
+    } else if (align > NATURAL_ALIGN) {
+        size_t front = (gFrontSize_B + align - 1) & ~(align - 1);
+        void* real = sysMemalign(align, front + size + gGuardSize_B);
+        if (NULL == real) {
+            return NULL;
+        }
+        if (zero) {
+            memset(real + front, 0, size);
+        }
+        rec = newRecord(real + front);
+        rec->real = real;
+        rec->flags = 0;
+    } else {
+        // NB: Mappings are always zeroed, so only this case needs care
+        size_t capacity = size + gFrontSize_B + gGuardSize_B;
+        void* real = zero ? sysCalloc(1, capacity) : sysMalloc(capacity);
+        if (NULL == real) {
+            return NULL;
+        }
+        rec = newRecord(real + gFrontSize_B);
+        rec->real = real;
+        rec->flags = 0;
+    }
+    rec->size = size;
+    rec->site = site;
+    rec->stack = stack;
+    fillGuard(rec);
+    siteAlloc(site, size);
+    return rec;
+}
+
+
+static Record* allocPageGuarded(size_t size, size_t align)
+{
+    // NB: The user block is rounded up to its alignment, so there may be a
+    // few bytes between its end and the protected page; these are used as a
+    // (small) back guard
+    size_t pageMask = gPageSize_B - 1;
+    size_t userSize = (size + align - 1) & ~(align - 1);
+    size_t front = gHeader ? gFrontSize_B : 0;
+    if ((gSampleMean > 0) && (front < SAMPLE_TAG_SIZE)) {
+        // Keep the bytes read by `isUntracked()` inside the mapping
+        front = SAMPLE_TAG_SIZE;
+    }
+    size_t dataSize = (front + userSize + pageMask) & ~pageMask;
+    size_t mapSize = dataSize + gPageSize_B;
+    void* real = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == real) {
+        return NULL;
+    }
+
+    void* ptr;
+    void* guard;
+    if (gPageUnderflow) {
+        ptr = real + gPageSize_B;
+        guard = real;
+    } else {
+        ptr = real + dataSize - userSize;
+        guard = real + dataSize;
+    }
+    if (mprotect(guard, gPageSize_B, PROT_NONE) != 0) {
+        // NB: Without its protected page the block would not be guarded at
+        // all, so fail rather than hand it out
+        int err = errno;
+        munmap(real, mapSize);
+        errno = err;
+        return NULL;
+    }
+    Record* rec = newRecord(ptr);
+    rec->real = real;
+    rec->mapSize = mapSize;
+    rec->flags = FLAG_PAGEGUARD;
+    return rec;
+}
+
+
+static Record* allocMapped(size_t size, size_t align)
+{
+    size_t pageMask = gPageSize_B - 1;
+    size_t front = (gFrontSize_B + align - 1) & ~(align - 1);
+    size_t mapSize = (front + size + gGuardSize_B + pageMask) & ~pageMask;
+    void* real = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == real) {
+        return NULL;
+    }
+    Record* rec = newRecord(real + front);
+    rec->real = real;
+    rec->mapSize = mapSize;
+    rec->flags = FLAG_MAPPED;
+    return rec;
+}
+
+
+static Record* newRecord(void* ptr)
+{
+    Record* rec;
+    if (gHeader) {
+        rec = ptr - gFrontSize_B;
+    } else {
+        rec = recordAlloc();
+    }
+    rec->ptr = ptr;
+    return rec;
+}
+
+
+static void releaseBlock(Record* rec)
+{
+    siteFree(rec->site, rec->size);
+    if (rec->flags & (FLAG_PAGEGUARD | FLAG_MAPPED)) {
+        munmap(rec->real, rec->mapSize);
+    } else {
+        sysFree(rec->real);
+    }
+    if (!gHeader) {
+        recordFree(rec);
+    }
+}
+
+
+static void checkKind(const Record* rec, int kind)
+{
+    static const char* allocators[] = {
+        "malloc()", "operator new", "operator new[]"
+    };
+    static const char* deallocators[] = {
+        "free()", "operator delete", "operator delete[]"
+    };
+    int allocKind = (rec->flags & FLAG_KIND_MASK) >> FLAG_KIND_SHIFT;
+    if ((allocKind == kind) || (kind < 0) || (kind > FLLOC_KIND_NEW_ARRAY)) {
+        return;
+    }
+    char site[SITE_BUF_SIZE];
+    siteFormat(rec->site, site, sizeof(site));
+    fprintf(gFile, "FLLOC: Deallocation mismatch: %p allocated with %s from "
+            "%s, freed with %s\n",
+            rec->ptr, allocators[allocKind], site, deallocators[kind]);
+    atomic_store_explicit(&gAllGood, 0, memory_order_relaxed);
+}
+
+
+static void fillGuard(Record* rec)
+{
+    memset(rec->ptr - frontGuardSize(rec), FLLOC_FILL, frontGuardSize(rec));
+    memset(rec->ptr + rec->size, FLLOC_FILL, backGuardSize(rec));
+}
+
+
+static void checkForCorruption(Record* rec)
+{
+    checkGuards(rec, gFrontGuard_B);
+}
+
+
+static void checkOnFree(Record* rec)
+{
+    ThreadState* ts = &tThread;
+    switch (gCheckPolicy) {
+    case CHECK_ALL :
+        checkGuards(rec, gFrontGuard_B);
+        break;
+
+    case CHECK_EVERY :
+        ts->checkCount++;
+        if (ts->checkCount >= gCheckParam) {
+            ts->checkCount = 0;
+            checkGuards(rec, gFrontGuard_B);
+        }
+        break;
+
+    case CHECK_RANDOM :
+        if ((threadRandom() >> 32) < gCheckParam) {
+            checkGuards(rec, gFrontGuard_B);
+        }
+        break;
+
+    case CHECK_EDGE :
+        checkGuards(rec, (gCheckParam < gGuardSize_B) ? gCheckParam
+                : gGuardSize_B);
+        break;
+    }
+}
+
+
+static void checkGuards(Record* rec, size_t size)
+{
+    size_t front = frontGuardSize(rec);
+    size_t back = backGuardSize(rec);
+    if (front > size) {
+        front = size;
+    }
+    if (back > size) {
+        back = size;
+    }
+    uint8_t* p = gGuardScan(rec->ptr - front, front);
+    if (NULL == p) {
+        p = gGuardScan(rec->ptr + rec->size, back);
+    }
+    if ((p != NULL) && !(rec->flags & FLAG_REPORTED)) {
+        char site[SITE_BUF_SIZE];
+        char stack[STACK_BUF_SIZE];
+        siteFormat(rec->site, site, sizeof(site));
+        stackFormat(rec->stack, stack, sizeof(stack));
+        fprintf(gFile, "FLLOC: Corruption detected at %p, "
+                "from block allocated at %s%s\n", p, site, stack);
+        rec->flags |= FLAG_REPORTED;
+        atomic_store_explicit(&gAllGood, 0, memory_order_relaxed);
+    }
+}
+
+
+static uint8_t* guardScanWord(uint8_t* p, size_t size)
+{
+    uint8_t* end = p + size;
+
+    // Check byte by byte until `p` is aligned on a word boundary
+    while ((p < end) && (((uintptr_t)p & 7) != 0)) {
+        if (*p != FLLOC_FILL) {
+            return p;
+        }
+        p++;
+    }
+
+    // NB: No need to locate the exact byte here; the loop below does that
+    while ((p + 8) <= end) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (word != FLLOC_FILL64) {
+            break;
+        }
+        p += 8;
+    }
+
+    while (p < end) {
+        if (*p != FLLOC_FILL) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+
+#ifdef __x86_64__
+static uint8_t* guardScanSse2(uint8_t* p, size_t size)
+{
+    // Compare the whole guard first, and only locate the bad byte if that
+    // comparison fails, which should be rare
+    const __m128i fill = _mm_set1_epi8((char)FLLOC_FILL);
+    __m128i diff = _mm_setzero_si128();
+    size_t i;
+    for (i = 0; (i + 16) <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        diff = _mm_or_si128(diff, _mm_xor_si128(v, fill));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+            != 0xffff) {
+        return guardScanWord(p, size);
+    }
+    return guardScanWord(p + i, size - i);
+}
+
+
+__attribute__ (( target("avx2") ))
+static uint8_t* guardScanAvx2(uint8_t* p, size_t size)
+{
+    const __m256i fill = _mm256_set1_epi8((char)FLLOC_FILL);
+    __m256i diff = _mm256_setzero_si256();
+    size_t i;
+    for (i = 0; (i + 32) <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(v, fill));
+    }
+    if (!_mm256_testz_si256(diff, diff)) {
+        return guardScanWord(p, size);
+    }
+    return guardScanWord(p + i, size - i);
+}
+#endif
+
+
+static void* scrubThread(void* arg)
+{
+#ifdef FLLOC_PRELOAD
+    tInside = 1;
+#endif
+    unsigned s = 0;
+    size_t pos = 0;
+    for (;;) {
+        Shard* shard = &(gShards[s]);
+        unsigned count = 0;
+        pthread_mutex_lock(&shard->mutex);
+        int done = scrubShard(shard, &pos, &count);
+        pthread_mutex_unlock(&shard->mutex);
+        if (done) {
+            s = (s + 1) & (gShardCount - 1);
+            pos = 0;
+        }
+
+        // Sleep long enough to keep to the configured rate; also sleep a bit
+        // when there is nothing to check, so we don't spin on empty shards
+        uint64_t ns = (count * 1000000000ULL) / gScrubRate;
+        if (0 == count) {
+            ns = 1000000ULL / gShardCount;
+        }
+        struct timespec ts;
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+
+static int scrubShard(Shard* shard, size_t* pos, unsigned* count)
+{
+    *count = 0;
+    if (gHeader) {
+        // NB: `headerRemove()` moves the cursor if it removes its record
+        if (0 == *pos) {
+            shard->scrubCursor = shard->records;
+            *pos = 1;
+        }
+        while ((shard->scrubCursor != NULL) && (*count < SCRUB_BATCH)) {
+            checkForCorruption(&shard->scrubCursor->rec);
+            shard->scrubCursor = shard->scrubCursor->next;
+            (*count)++;
+        }
+        return (NULL == shard->scrubCursor);
+    }
+
+    if (NULL == shard->slots) {
+        return 1;
+    }
+    // NB: Records may have moved since last time, because of insertions and
+    // removals; this is fine, we are not trying to be exact here
+    size_t end = *pos + (4 * SCRUB_BATCH);
+    while ((*pos <= shard->mask) && (*pos < end) && (*count < SCRUB_BATCH)) {
+        Slot* slot = &(shard->slots[*pos]);
+        if (slot->key != NULL) {
+            checkForCorruption(slot->rec);
+            (*count)++;
+        }
+        (*pos)++;
+    }
+    return (*pos > shard->mask);
+}
+
+
+static TraceRing* traceRing(void)
+{
+    ThreadState* ts = &tThread;
+    if (ts->trace != NULL) {
+        return ts->trace;
+    }
+    // NB: Registering the thread gets us notified when it exits
+    if (NULL == threadState()) {
+        return NULL;
+    }
+
+    // Take the ring of a thread which has exited, if there is one
+    TraceRing* ring;
+    for (ring = atomic_load_explicit(&gTraceRings, memory_order_acquire);
+            ring != NULL; ring = ring->next) {
+        int expected = RING_FREE;
+        if (atomic_compare_exchange_strong_explicit(&ring->state, &expected,
+                    RING_ACTIVE, memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (NULL == ring) {
+        // NB: mmap() gives us a zeroed ring, i.e. empty and RING_ACTIVE
+        ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == ring) {
+            return NULL;
+        }
+        ring->next = atomic_load_explicit(&gTraceRings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&gTraceRings,
+                    &ring->next, ring, memory_order_release,
+                    memory_order_relaxed)) {
+        }
+    }
+    ring->thread = atomic_fetch_add_explicit(&gTraceThreads, 1,
+            memory_order_relaxed);
+    ts->trace = ring;
+    return ring;
+}
+
+
+static void traceRecord(int type, void* ptr, size_t size, uint32_t site)
+{
+    TraceRing* ring = traceRing();
+    if (NULL == ring) {
+        atomic_fetch_add_explicit(&gTraceLost, 1, memory_order_relaxed);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if ((head - tail) >= TRACE_RING_EVENTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    FllocTraceEvent* event = &(ring->events[head & (TRACE_RING_EVENTS - 1)]);
+    event->time = (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+    event->ptr = (uintptr_t)ptr;
+    event->size = size;
+    event->site = site;
+    event->thread = ring->thread;
+    event->type = type;
+    event->reserved = 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+static void traceWrite(const void* buf, size_t size)
+{
+    static int failed = 0;
+    while ((size > 0) && !failed) {
+        ssize_t n = write(gTraceFd, buf, size);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            fprintf(stderr, "FLLOC WARNING: Failed to write the trace: %s\n",
+                    strerror(errno));
+            failed = 1;
+            break;
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+
+static size_t traceDrain(void)
+{
+    size_t count = 0;
+    TraceRing* ring;
+    for (ring = atomic_load_explicit(&gTraceRings, memory_order_acquire);
+            ring != NULL; ring = ring->next) {
+        // NB: Read the state first, so an exited ring is known to be complete
+        int state = atomic_load_explicit(&ring->state, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail < head) {
+            // Write the events up to the end of the buffer in one go
+            size_t start = tail & (TRACE_RING_EVENTS - 1);
+            size_t n = head - tail;
+            if (n > (TRACE_RING_EVENTS - start)) {
+                n = TRACE_RING_EVENTS - start;
+            }
+            traceWrite(&(ring->events[start]), n * sizeof(FllocTraceEvent));
+            tail += n;
+            count += n;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        if (RING_EXITED == state) {
+            atomic_store_explicit(&ring->state, RING_FREE,
+                    memory_order_release);
+        }
+    }
+    return count;
+}
+
+
+static void* traceThread(void* arg)
+{
+#ifdef FLLOC_PRELOAD
+    tInside = 1;
+#endif
+    for (;;) {
+        int stop = atomic_load_explicit(&gTraceStop, memory_order_acquire);
+        size_t count = traceDrain();
+        gTraceHeader.count += count;
+        if (stop) {
+            break;
+        }
+        if (0 == count) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = TRACE_PERIOD_NS;
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+static void traceFinish(void)
+{
+    if (gTraceFd < 0) {
+        return;
+    }
+    atomic_store_explicit(&gTraceStop, 1, memory_order_release);
+    pthread_join(gTraceThread, NULL);
+
+    // NB: Events recorded from now on stay in the ring buffers
+    uint64_t dropped = atomic_load_explicit(&gTraceLost, memory_order_relaxed);
+    TraceRing* ring;
+    for (ring = atomic_load_explicit(&gTraceRings, memory_order_acquire);
+            ring != NULL; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    gTraceHeader.dropped = dropped;
+    if (pwrite(gTraceFd, &gTraceHeader, sizeof(gTraceHeader), 0)
+            != sizeof(gTraceHeader)) {
+        fprintf(stderr, "FLLOC WARNING: Failed to write the trace header\n");
+    }
+    close(gTraceFd);
+    if (dropped > 0) {
+        fprintf(stderr, "FLLOC WARNING: %llu allocation events could not be "
+                "traced because the trace ring buffers were full\n",
+                (unsigned long long)dropped);
+    }
+
+    uint32_t count = atomic_load_explicit(&gSiteCount, memory_order_acquire);
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        char site[SITE_BUF_SIZE];
+        siteFormat(i, site, sizeof(site));
+        fprintf(gTraceSites, "%u %s\n", i, site);
+    }
+    fclose(gTraceSites);
+}
+
+
+static uint32_t siteIntern(const char* file, int line, void* caller)
+{
+    size_t mask = (2 * MAX_SITES) - 1;
+    size_t h = ptrHash((void*)((uintptr_t)file ^ ((uint64_t)line << 48)));
+    h = ptrHash((void*)(h ^ (uintptr_t)caller));
+    size_t i;
+    for (i = 0; i <= mask; i++) {
+        atomic_uint* slot = &(gSiteIndex[(h + i) & mask]);
+        uint32_t index = atomic_load_explicit(slot, memory_order_acquire);
+        if (0 == index) {
+            // Not found; add it, unless someone else did it in the meantime
+            pthread_mutex_lock(&gSiteMutex);
+            index = atomic_load_explicit(slot, memory_order_relaxed);
+            if (0 == index) {
+                index = atomic_load_explicit(&gSiteCount,
+                        memory_order_relaxed);
+                if (index >= MAX_SITES) {
+                    pthread_mutex_unlock(&gSiteMutex);
+                    return 0;
+                }
+                gSites[index].file = file;
+                gSites[index].line = line;
+                gSites[index].caller = caller;
+                atomic_store_explicit(&gSiteCount, index + 1,
+                        memory_order_release);
+                atomic_store_explicit(slot, index, memory_order_release);
+            }
+            pthread_mutex_unlock(&gSiteMutex);
+        }
+        if ((gSites[index].file == file) && (gSites[index].line == line)
+                && (gSites[index].caller == caller)) {
+            return index;
+        }
+    }
+    return 0;
+}
+
+
+static uint32_t stackIntern(void* const* frames, unsigned n)
+{
+    uint64_t h = n;
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        h = ptrHash((void*)(h ^ (uintptr_t)frames[i]));
+    }
+
+    size_t mask = (2 * MAX_STACKS) - 1;
+    size_t j;
+    for (j = 0; j <= mask; j++) {
+        atomic_uint* slot = &(gStackIndex[(h + j) & mask]);
+        uint32_t index = atomic_load_explicit(slot, memory_order_acquire);
+        if (0 == index) {
+            // Not found; add it, unless someone else did it in the meantime
+            pthread_mutex_lock(&gStackMutex);
+            index = atomic_load_explicit(slot, memory_order_relaxed);
+            if (0 == index) {
+                index = atomic_load_explicit(&gStackCount,
+                        memory_order_relaxed);
+                if (index >= MAX_STACKS) {
+                    pthread_mutex_unlock(&gStackMutex);
+                    return 0;
+                }
+                memcpy(&(gStackFrames[index * gStackDepth]), frames,
+                        n * sizeof(*frames));
+                gStackSizes[index] = n;
+                atomic_store_explicit(&gStackCount, index + 1,
+                        memory_order_release);
+                atomic_store_explicit(slot, index, memory_order_release);
+            }
+            pthread_mutex_unlock(&gStackMutex);
+        }
+        if ((gStackSizes[index] == n) && (memcmp(frames,
+                        &(gStackFrames[index * gStackDepth]),
+                        n * sizeof(*frames)) == 0)) {
+            return index;
+        }
+    }
+    return 0;
+}
+
+
+static void stackFormat(uint32_t stack, char* buf, size_t size)
+{
+    buf[0] = '\0';
+    if (0 == stack) {
+        return;
+    }
+    int len = snprintf(buf, size, "; stack:");
+    unsigned i;
+    for (i = 0; (i < gStackSizes[stack]) && (len > 0) && ((size_t)len < size);
+            i++) {
+        len += snprintf(buf + len, size - len, " %p",
+                gStackFrames[(stack * gStackDepth) + i]);
+    }
+}
+
+
+static uint64_t threadRandom(void)
+{
+    ThreadState* ts = &tThread;
+    if (0 == ts->random) {
+        ts->random = ptrHash(ts) | 1;
+    }
+    // xorshift64
+    ts->random ^= ts->random << 13;
+    ts->random ^= ts->random >> 7;
+    ts->random ^= ts->random << 17;
+    return ts->random;
+}
+
+
+/** Approximate `log2(x)` for `x > 0`, without needing libm */
+static double fastLog2(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double m; // in [1, 2)
+    memcpy(&m, &bits, sizeof(m));
+    return e - 1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955
+                    - (0.056570851 * m)) * m) * m) * m;
+}
+
+
+/** Approximate `1 - exp(-x)` for `x >= 0`, without needing libm */
+static double fastProbability(double x)
+{
+    if (x < 1e-3) {
+        return x * (1.0 - (x * (0.5 - (x / 6.0))));
+    }
+    if (x > 40.0) {
+        return 1.0;
+    }
+    // exp(-x) = exp(-x / 2^k) ^ (2^k)
+    int k = 0;
+    while (x > 1e-3) {
+        x /= 2.0;
+        k++;
+    }
+    double e = 1.0 - (x * (1.0 - (x * (0.5 - (x / 6.0)))));
+    while (k-- > 0) {
+        e *= e;
+    }
+    return 1.0 - e;
+}
+
+
+static int sampleTake(size_t size)
+{
+    ThreadState* ts = &tThread;
+    ts->sampleLeft -= size;
+    if (ts->sampleLeft >= 0) {
+        return 0;
+    }
+    // Draw the distance to the next sample; `u` is in (0, 1]
+    double u = ((threadRandom() >> 11) + 1) * (1.0 / (1ULL << 53));
+    ts->sampleLeft = (int64_t)(-fastLog2(u) * 0.6931471805599453
+            * gSampleMean) + 1;
+    return 1;
+}
+
+
+static double sampleWeight(size_t size)
+{
+    if (0 == gSampleMean) {
+        return 1.0;
+    }
+    return 1.0 / fastProbability((double)size / gSampleMean);
+}
+
+
+static void* untrackedAlloc(size_t size, int zero)
+{
+    if (size > (SIZE_MAX - gUntrackedFront_B)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* real;
+    if (gUntrackedFront_B > SAMPLE_TAG_SIZE) {
+        real = sysMemalign(gAlign_B, size + gUntrackedFront_B);
+        if ((real != NULL) && zero) {
+            memset(real + gUntrackedFront_B, 0, size);
+        }
+    } else if (zero) {
+        real = sysCalloc(1, size + gUntrackedFront_B);
+    } else {
+        real = sysMalloc(size + gUntrackedFront_B);
+    }
+    if (NULL == real) {
+        return NULL;
+    }
+    void* ptr = real + gUntrackedFront_B;
+    uint64_t* tag = ptr - SAMPLE_TAG_SIZE;
+    tag[0] = SAMPLE_MAGIC ^ (uintptr_t)ptr;
+    tag[1] = size;
+    return ptr;
+}
+
+
+static void* untrackedRealloc(void* ptr, size_t size)
+{
+    if (gUntrackedFront_B > SAMPLE_TAG_SIZE) {
+        // NB: `realloc(3)` does not keep alignments above the natural one
+        void* newPtr = untrackedAlloc(size, 0);
+        if (newPtr != NULL) {
+            size_t oldSize = untrackedSize(ptr);
+            memcpy(newPtr, ptr, (size < oldSize) ? size : oldSize);
+            untrackedFree(ptr);
+        }
+        return newPtr;
+    }
+    if (size > (SIZE_MAX - SAMPLE_TAG_SIZE)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t* tag = sysRealloc(ptr - SAMPLE_TAG_SIZE, size + SAMPLE_TAG_SIZE);
+    if (NULL == tag) {
+        return NULL;
+    }
+    ptr = (void*)tag + SAMPLE_TAG_SIZE;
+    tag[0] = SAMPLE_MAGIC ^ (uintptr_t)ptr;
+    tag[1] = size;
+    return ptr;
+}
+
+
+static void untrackedFree(void* ptr)
+{
+    uint64_t* tag = ptr - SAMPLE_TAG_SIZE;
+    tag[0] = 0; // so a double free is reported as an unknown pointer
+    sysFree(ptr - gUntrackedFront_B);
+}
+
+
+static void siteFormat(uint32_t site, char* buf, size_t size)
+{
+    const Site* s = &(gSites[site]);
+    if ((s->file != NULL) && (s->line > 0)) {
+        snprintf(buf, size, "%s:%d", s->file, s->line);
+    } else if (s->file != NULL) {
+        snprintf(buf, size, "%s", s->file);
+    } else if (s->caller != NULL) {
+        snprintf(buf, size, "%p", s->caller);
+    } else {
+        snprintf(buf, size, "unknown");
+    }
+}
 
 
-/** Initialise the guard buffers if applicable */
-static void fillGuard(Record* rec);
+static void siteAlloc(uint32_t site, size_t size)
+{
+    Site* s = &(gSites[site]);
+    atomic_fetch_add_explicit(&s->liveCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->totalCount, 1, memory_order_relaxed);
+    uint64_t bytes = atomic_fetch_add_explicit(&s->liveBytes, size,
+            memory_order_relaxed) + size;
+    uint64_t peak = atomic_load_explicit(&s->peakBytes, memory_order_relaxed);
+    while ((bytes > peak) && !atomic_compare_exchange_weak_explicit(
+                &s->peakBytes, &peak, bytes, memory_order_relaxed,
+                memory_order_relaxed)) {
+    }
+}
 
 
-/** Check for signs of corruption in the guard buffers */
-static void checkForCorruption(Record* rec);
+static void siteFree(uint32_t site, size_t size)
+{
+    Site* s = &(gSites[site]);
+    atomic_fetch_sub_explicit(&s->liveCount, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&s->liveBytes, size, memory_order_relaxed);
+}
 
 
-/** Function to be run at the very end to check for memory leaks */
-static void fllocCheck(void);
+static void printStats(void)
+{
+    uint32_t count = atomic_load_explicit(&gSiteCount, memory_order_acquire);
+    uint64_t allTotal = 0;
+    uint64_t allLive = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        Site* s = &(gSites[i]);
+        uint64_t total = atomic_load_explicit(&s->totalCount,
+                memory_order_relaxed);
+        if (0 == total) {
+            continue;
+        }
+        uint64_t liveCount = atomic_load_explicit(&s->liveCount,
+                memory_order_relaxed);
+        allTotal += total;
+        allLive += liveCount;
+        uint64_t liveBytes = atomic_load_explicit(&s->liveBytes,
+                memory_order_relaxed);
+        char site[SITE_BUF_SIZE];
+        siteFormat(i, site, sizeof(site));
+        fprintf(gFile, "FLLOC: Site %s: %llu blocks allocated, "
+                "%llu still allocated (%llu bytes), peak %llu bytes",
+                site, (unsigned long long)total,
+                (unsigned long long)liveCount, (unsigned long long)liveBytes,
+                (unsigned long long)atomic_load_explicit(&s->peakBytes,
+                    memory_order_relaxed));
+        if ((gSampleMean > 0) && (liveCount > 0)) {
+            // NB: The counters only see sampled blocks; scale them assuming
+            // all blocks from this site have about the same size
+            double weight = sampleWeight(liveBytes / liveCount);
+            fprintf(gFile, "; estimated %.0f still allocated (%.0f bytes)",
+                    weight * liveCount, weight * liveBytes);
+        }
+        fprintf(gFile, "\n");
+    }
 
+    // NB: This does not count the extra padding of blocks with a larger
+    // alignment, nor page-guarded blocks, which have no front guard
+    size_t padding = gFrontGuard_B - gGuardSize_B;
+    if (padding > 0) {
+        fprintf(gFile, "FLLOC: Alignment padding: %zu bytes per block to align "
+                "to %zu bytes; %llu bytes in blocks still allocated, %llu "
+                "bytes overall\n", padding, gAlign_B,
+                (unsigned long long)(padding * allLive),
+                (unsigned long long)(padding * allTotal));
+    }
+}
 
 
-/*------------------------------------+
- | Implementation of public functions |
- +------------------------------------*/
+static void reportLeak(Record* rec, LeakSite* leaks)
+{
+    checkForCorruption(rec);
+    atomic_store_explicit(&gAllGood, 0, memory_order_relaxed);
+    if (NULL == leaks) {
+        char site[SITE_BUF_SIZE];
+        char stack[STACK_BUF_SIZE];
+        siteFormat(rec->site, site, sizeof(site));
+        stackFormat(rec->stack, stack, sizeof(stack));
+        fprintf(gFile, "FLLOC: Memory leak detected: %p never freed; "
+                "allocated from %s%s\n", rec->ptr, site, stack);
+        return;
+    }
+    LeakSite* leak = &(leaks[rec->site]);
+    if (0 == leak->count) {
+        leak->stack = rec->stack;
+    }
+    if (leak->count < REPORT_SAMPLES) {
+        leak->samples[leak->count] = rec->ptr;
+    }
+    leak->count++;
+    leak->bytes += rec->size;
+    double weight = sampleWeight(rec->size);
+    leak->estBlocks += weight;
+    leak->estBytes += weight * rec->size;
+}
 
 
-void* FllocMalloc(size_t size, const char* file, int line)
+static void* scanThread(void* arg)
 {
-    pthread_mutex_lock(&gMutex);
-    initIfNeeded();
-    void* ptr = doRealloc(NULL, size, file, line);
-    pthread_mutex_unlock(&gMutex);
-    return ptr;
+#ifdef FLLOC_PRELOAD
+    // NB: The shard mutexes are held, so tracking anything would deadlock
+    tInside = 1;
+#endif
+    Scanner* scanner = arg;
+    size_t lfChunks = 0;
+    if (gLfSlots != NULL) {
+        lfChunks = ((gLfMask + 1) + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    }
+    for (;;) {
+        size_t unit = atomic_fetch_add_explicit(scanner->next, 1,
+                memory_order_relaxed);
+        if (unit >= scanner->count) {
+            break;
+        }
+        size_t i;
+        if (unit < lfChunks) {
+            size_t end = (unit + 1) * SCAN_CHUNK;
+            if (end > (gLfMask + 1)) {
+                end = gLfMask + 1;
+            }
+            for (i = unit * SCAN_CHUNK; i < end; i++) {
+                Record* rec = atomic_load_explicit(&(gLfSlots[i].rec),
+                        memory_order_acquire);
+                if (rec != NULL) {
+                    reportLeak(rec, scanner->leaks);
+                }
+            }
+            continue;
+        }
+
+        Shard* shard = &(gShards[unit - lfChunks]);
+        for (i = 0; (shard->slots != NULL) && (i <= shard->mask); i++) {
+            if (shard->slots[i].key != NULL) {
+                reportLeak(shard->slots[i].rec, scanner->leaks);
+            }
+        }
+        for (i = shard->migrated;
+                (shard->oldSlots != NULL) && (i <= shard->oldMask); i++) {
+            if (shard->oldSlots[i].rec != NULL) {
+                reportLeak(shard->oldSlots[i].rec, scanner->leaks);
+            }
+        }
+        HeaderRecord* hdr;
+        for (hdr = shard->records; hdr != NULL; hdr = hdr->next) {
+            reportLeak(&hdr->rec, scanner->leaks);
+        }
+    }
+    return NULL;
 }
 
 
-void* FllocCalloc(size_t nmemb, size_t mbsize, const char* file, int line)
+static LeakSite* leaksAlloc(void)
 {
-    pthread_mutex_lock(&gMutex);
-    initIfNeeded();
-    size_t size = nmemb * mbsize;
-    void* ptr = doRealloc(NULL, size, file, line);
-    if (ptr != NULL) {
-        // NB: `calloc(3)` is supposed to initialise the memory to 0
-        memset(ptr, 0, size);
+    LeakSite* leaks = mmap(NULL, MAX_SITES * sizeof(*leaks),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == leaks) {
+        return NULL;
     }
-    pthread_mutex_unlock(&gMutex);
-    return ptr;
+    return leaks;
 }
 
 
-void* FllocRealloc(void* old, size_t size, const char* file, int line)
+static void leaksMerge(LeakSite* dst, const LeakSite* src)
 {
-    pthread_mutex_lock(&gMutex);
-    initIfNeeded();
-    void* ptr = doRealloc(old, size, file, line);
-    pthread_mutex_unlock(&gMutex);
-    return ptr;
+    uint32_t i;
+    for (i = 0; i < MAX_SITES; i++) {
+        if (0 == src[i].count) {
+            continue;
+        }
+        if (0 == dst[i].count) {
+            dst[i].stack = src[i].stack;
+        }
+        uint64_t k;
+        for (k = 0; (k < src[i].count) && (k < REPORT_SAMPLES)
+                && (dst[i].count + k < REPORT_SAMPLES); k++) {
+            dst[i].samples[dst[i].count + k] = src[i].samples[k];
+        }
+        dst[i].count += src[i].count;
+        dst[i].bytes += src[i].bytes;
+        dst[i].estBlocks += src[i].estBlocks;
+        dst[i].estBytes += src[i].estBytes;
+    }
 }
 
 
-void FllocFree(void* ptr, const char* file, int line)
+static int compareLeaks(const void* a, const void* b)
 {
-    if (NULL == ptr) {
-        return;
+    const LeakSite* x = a;
+    const LeakSite* y = b;
+    if (x->estBytes != y->estBytes) {
+        return (x->estBytes > y->estBytes) ? -1 : 1;
     }
-    pthread_mutex_lock(&gMutex);
-    initIfNeeded();
-    Record* rec = recordRemove(ptr - gGuardSize_B);
-    if (NULL == rec) {
-        fprintf(stderr, "FLLOC FATAL: Unknown pointer %p when freeing memory\n",
-                ptr);
-        abort();
+    if (x->count != y->count) {
+        return (x->count > y->count) ? -1 : 1;
     }
-    checkForCorruption(rec);
-    free(rec->real);
-    free(rec);
-    pthread_mutex_unlock(&gMutex);
+    return (x->site < y->site) ? -1 : (x->site > y->site);
 }
 
 
-char* FllocStrdup(const char* s, const char* file, int line)
+static void printLeaks(LeakSite* leaks)
 {
-    if (NULL == s) {
-        fprintf(stderr, "FLLOC FATAL: strdup() called with NULL argument\n");
-        abort();
+    // Move the sites which leaked to the front, then sort them
+    size_t n = 0;
+    uint32_t i;
+    for (i = 0; i < MAX_SITES; i++) {
+        if (leaks[i].count > 0) {
+            leaks[n] = leaks[i];
+            leaks[n].site = i;
+            n++;
+        }
     }
-    size_t size = strlen(s);
-    char* str = FllocMalloc(size + 1, file, line);
-    if (str != NULL) {
-        strcpy(str, s);
+    qsort(leaks, n, sizeof(*leaks), compareLeaks);
+
+    size_t j;
+    for (j = 0; j < n; j++) {
+        LeakSite* leak = &(leaks[j]);
+        char site[SITE_BUF_SIZE];
+        siteFormat(leak->site, site, sizeof(site));
+        fprintf(gFile, "FLLOC: Memory leak detected: %llu block(s) "
+                "(%llu bytes) never freed; allocated from %s; e.g.",
+                (unsigned long long)leak->count,
+                (unsigned long long)leak->bytes, site);
+        uint64_t k;
+        for (k = 0; (k < leak->count) && (k < REPORT_SAMPLES); k++) {
+            fprintf(gFile, " %p", leak->samples[k]);
+        }
+        if (gSampleMean > 0) {
+            fprintf(gFile, "; estimated %.0f block(s) (%.0f bytes)",
+                    leak->estBlocks, leak->estBytes);
+        }
+        char stack[STACK_BUF_SIZE];
+        stackFormat(leak->stack, stack, sizeof(stack));
+        fprintf(gFile, "%s\n", stack);
     }
-    return str;
 }
 
 
-char* FllocStrndup(const char* s, size_t n, const char* file, int line)
+static void fllocCheck(void)
 {
-    if ((NULL == s) && (n > 0)) {
-        fprintf(stderr, "FLLOC FATAL: strndup() called with NULL argument "
-                "and >0 length\n");
-        abort();
+#ifdef FLLOC_PRELOAD
+    int inside = tInside;
+    tInside = 1;
+#endif
+    traceFinish();
+    LeakSite* leaks = NULL;
+    if (gReportGrouped) {
+        // NB: If this fails, better a long report than no report
+        leaks = leaksAlloc();
     }
-    if ((s != NULL) && (strlen(s) < n)) {
-        n = strlen(s);
+
+    if (gLfSlots != NULL) {
+        // The lock-free table has no locks to keep records from being freed
+        // while they are scanned
+        lfPauseFrees();
     }
-    char* str = FllocMalloc(n + 1, file, line);
-    if (str != NULL) {
-        strncpy(str, s, n);
-        str[n] = '\0';
+    cacheFlushAll();
+    unsigned s;
+    for (s = 0; s < gShardCount; s++) {
+        pthread_mutex_lock(&(gShards[s].mutex));
     }
-    return str;
+
+    // Share the scan between this thread and `gScanThreads - 1` others; each
+    // of them collects its own grouped leaks, which are merged at the end
+    atomic_size_t next = 0;
+    size_t count = gShardCount;
+    if (gLfSlots != NULL) {
+        count += ((gLfMask + 1) + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    }
+    Scanner scanners[MAX_SCAN_THREADS];
+    pthread_t threads[MAX_SCAN_THREADS];
+    unsigned nthreads = 1;
+    scanners[0].next = &next;
+    scanners[0].count = count;
+    scanners[0].leaks = leaks;
+    for ( ; nthreads < gScanThreads; nthreads++) {
+        Scanner* scanner = &(scanners[nthreads]);
+        scanner->next = &next;
+        scanner->count = count;
+        scanner->leaks = NULL;
+        if (leaks != NULL) {
+            scanner->leaks = leaksAlloc();
+            if (NULL == scanner->leaks) {
+                break;
+            }
+        }
+        if (pthread_create(&(threads[nthreads]), NULL, scanThread,
+                    scanner) != 0) {
+            if (scanner->leaks != NULL) {
+                munmap(scanner->leaks, MAX_SITES * sizeof(*leaks));
+            }
+            break;
+        }
+    }
+    scanThread(&(scanners[0]));
+    unsigned t;
+    for (t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        if (scanners[t].leaks != NULL) {
+            leaksMerge(leaks, scanners[t].leaks);
+            munmap(scanners[t].leaks, MAX_SITES * sizeof(*leaks));
+        }
+    }
+
+    for (s = 0; s < gShardCount; s++) {
+        pthread_mutex_unlock(&(gShards[s].mutex));
+    }
+    if (gLfSlots != NULL) {
+        lfResumeFrees();
+    }
+    if (leaks != NULL) {
+        printLeaks(leaks);
+        munmap(leaks, MAX_SITES * sizeof(*leaks));
+    }
+    if (gStats) {
+        printStats();
+    }
+    if (atomic_load_explicit(&gAllGood, memory_order_relaxed)) {
+        fprintf(gFile, "FLLOC: No memory leak or corruption detected\n");
+    }
+#ifdef FLLOC_PRELOAD
+    tInside = inside;
+#endif
 }
 
 
 
-/*----------------------------------+
- | Private function implementations |
- +----------------------------------*/
+#ifdef FLLOC_PRELOAD
 
+/*--------------+
+ | Preload mode |
+ +--------------*/
 
-static inline uint16_t ptr2index(void* real)
-{
-    return ((uint32_t)real) >> 4;
-}
 
+/* In preload mode, flloc is built as a shared library which replaces the
+ * allocation functions of the C library:
+ *
+ *     $ LD_PRELOAD=./libflloc.so FLLOC_CONFIG="STACK=16" ./program
+ *
+ * Sites are the return addresses of the interposed functions. Blocks which
+ * flloc could not track (because they have been allocated while flloc itself
+ * was running, or before it was ready) are handed back to the C library.
+ */
 
-static void recordInsert(Record* rec)
+
+/** Find the real allocation functions */
+static void preloadResolve(void)
 {
-    uint16_t index = ptr2index(rec->real);
-    rec->next = NULL;
-    Record* curr = &(gRecords[index]);
-    while (curr->next != NULL) {
-        curr = curr->next;
+    gResolving = 1;
+    gRealMalloc = dlsym(RTLD_NEXT, "malloc");
+    gRealCalloc = dlsym(RTLD_NEXT, "calloc");
+    gRealRealloc = dlsym(RTLD_NEXT, "realloc");
+    gRealPosixMemalign = dlsym(RTLD_NEXT, "posix_memalign");
+    gRealUsableSize = dlsym(RTLD_NEXT, "malloc_usable_size");
+    gRealFree = dlsym(RTLD_NEXT, "free");
+    gResolving = 0;
+    if ((NULL == gRealMalloc) || (NULL == gRealCalloc) || (NULL == gRealRealloc)
+            || (NULL == gRealPosixMemalign) || (NULL == gRealUsableSize)
+            || (NULL == gRealFree)) {
+        fprintf(stderr, "FLLOC FATAL: Can't find the allocation functions of "
+                "the C library\n");
+        abort();
     }
-    curr->next = rec;
 }
 
 
-static Record* recordRemove(void* real)
+/** Check whether an interposed function must bypass flloc
+ *
+ * This is the case while flloc is running on the current thread, and while
+ * the real functions are being looked up.
+ */
+static inline int preloadBypass(void)
 {
-    uint16_t index = ptr2index(real);
-    Record* rec = NULL;
-    Record* curr = &(gRecords[index]);
-    while ((curr->next != NULL) && (NULL == rec)) {
-        if (curr->next->real == real) {
-            rec = curr->next;
-            curr->next = curr->next->next;
-        } else {
-            curr = curr->next;
+    if (NULL == gRealFree) {
+        if (gResolving) {
+            return 1;
         }
+        preloadResolve();
     }
-    return rec;
+    return tInside;
 }
 
 
-static void initIfNeeded(void)
+/** Allocate a (zeroed) block from the bootstrap arena */
+static void* bootstrapAlloc(size_t align, size_t size)
 {
-    if (gInitialised) {
-        return;
+    if (align < 16) {
+        align = 16;
     }
-    gInitialised = 1;
-    gFile = stderr;
+    size_t used = atomic_load_explicit(&gBootstrapUsed, memory_order_relaxed);
+    size_t start;
+    do {
+        start = (used + sizeof(size_t) + align - 1) & ~(align - 1);
+        if ((size > BOOTSTRAP_SIZE) || ((start + size) > BOOTSTRAP_SIZE)) {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&gBootstrapUsed, &used,
+                start + size, memory_order_relaxed, memory_order_relaxed));
+    ((size_t*)(gBootstrap + start))[-1] = size;
+    return gBootstrap + start;
+}
 
-    memset(gRecords, 0, sizeof(gRecords));
-    atexit(fllocCheck);
 
-    const char* str = getenv("FLLOC_CONFIG");
-    if (str != NULL) {
-        char* s = strdup(str);
-        if (NULL == s) {
-            fprintf(stderr, "FLLOC FATAL: critical strdup() failed\n");
-            abort();
-        }
-        char* saveptr;
-        char* token = strtok_r(s, ";", &saveptr);
-        while (token != NULL) {
-            char* saveptr2;
-            char* name = strtok_r(token, "=", &saveptr2);
-            char* value = strtok_r(NULL, "=", &saveptr2);
-            if ((name != NULL) && (value != NULL)) {
-                parseConfig(name, value);
-            }
-            token = strtok_r(NULL, ";", &saveptr);
+static inline int isBootstrap(void* ptr)
+{
+    return ((uint8_t*)ptr >= gBootstrap)
+        && ((uint8_t*)ptr < (gBootstrap + BOOTSTRAP_SIZE));
+}
+
+
+/** Allocate an aligned block; see `posix_memalign(3)` */
+static inline __attribute__ (( always_inline )) void* preloadAligned(
+        size_t align, size_t size, void* caller)
+{
+    if (preloadBypass()) {
+        if (gResolving) {
+            return bootstrapAlloc(align, size);
         }
-        free(s);
+        return sysMemalign(align, size);
     }
+    tInside = 1;
+    initIfNeeded();
+    void* ptr = alignedPublic(align, (size > 0) ? size : 1, NULL, 0, caller);
+    tInside = 0;
+    return ptr;
 }
 
 
-static void parseConfig(const char* name, const char* value)
+/** Re-allocate a block; see `realloc(3)` */
+static inline __attribute__ (( always_inline )) void* preloadRealloc(
+        void* old, size_t size, void* caller)
 {
-    if (strcmp(name, "FILE") == 0) {
-        if ((gFile != NULL) && (gFile != stderr)) {
-            fclose(gFile);
+    if ((old != NULL) && isBootstrap(old)) {
+        size_t oldSize = ((size_t*)old)[-1];
+        void* ptr = malloc(size);
+        if (ptr != NULL) {
+            memcpy(ptr, old, (size < oldSize) ? size : oldSize);
         }
-        gFile = fopen(value, "w");
-        if (NULL == gFile) {
-            fprintf(stderr, "FLLOC FATAL: Can't open '%s' for writing\n",
-                    value);
-            abort();
+        return ptr;
+    }
+    if (preloadBypass()) {
+        if (gResolving) {
+            return (NULL == old) ? bootstrapAlloc(16, size) : NULL;
         }
+        return sysRealloc(old, size);
+    }
+    if ((old != NULL) && (0 == size)) {
+        free(old);
+        return NULL;
+    }
+    tInside = 1;
+    initIfNeeded();
+    void* ptr = reallocPublic(old, (size > 0) ? size : 1, NULL, 0, caller);
+    tInside = 0;
+    return ptr;
+}
 
-    } else if (strcmp(name, "GUARD") == 0) {
-        unsigned long tmp;
-        if (sscanf(value, "%lu", &tmp) != 1) {
-            fprintf(stderr, "FLLOC FATAL: Invalid GUARD value '%s'\n", value);
-            abort();
-        }
-        gGuardSize_B = tmp;
 
-    } else {
-        fprintf(stderr, "FLLOC WARNING: Unknown parameter '%s'; ignored\n",
-                name);
+void* malloc(size_t size)
+{
+    if (preloadBypass()) {
+        if (gResolving) {
+            return bootstrapAlloc(16, size);
+        }
+        return sysMalloc(size);
     }
+    tInside = 1;
+    initIfNeeded();
+    void* ptr = allocPublic((size > 0) ? size : 1, NULL, 0,
+            __builtin_return_address(0));
+    tInside = 0;
+    return ptr;
 }
 
 
-static void* doRealloc(void* old, size_t size, const char* file, int line)
+void* calloc(size_t nmemb, size_t size)
 {
-    if (0 == size) {
-        return NULL;
+    if (preloadBypass()) {
+        if (gResolving) {
+            if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+                return NULL;
+            }
+            return bootstrapAlloc(16, nmemb * size);
+        }
+        return sysCalloc(nmemb, size);
     }
-
-    size_t capacity = size + (2 * gGuardSize_B);
-    void* real = malloc(capacity);
-    if (NULL == real) {
-        return NULL;
+    if ((0 == nmemb) || (0 == size)) {
+        nmemb = 1;
+        size = 1;
     }
+    tInside = 1;
+    initIfNeeded();
+    void* ptr = callocPublic(nmemb, size, NULL, 0,
+            __builtin_return_address(0));
+    tInside = 0;
+    return ptr;
+}
 
-    Record* rec = malloc(sizeof(*rec));
-    if (NULL == rec) {
-        free(real);
+
+void* realloc(void* old, size_t size)
+{
+    return preloadRealloc(old, size, __builtin_return_address(0));
+}
+
+
+void* reallocarray(void* old, size_t nmemb, size_t size)
+{
+    if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+        errno = ENOMEM;
         return NULL;
     }
+    return preloadRealloc(old, nmemb * size, __builtin_return_address(0));
+}
 
-    rec->real = real;
-    rec->size = size;
-    rec->file = file;
-    rec->line = line;
-    fillGuard(rec);
-    recordInsert(rec);
 
-    void* ptr = NULL;
-    if (real != NULL) {
-        ptr = real + gGuardSize_B;
+void free(void* ptr)
+{
+    if ((NULL == ptr) || isBootstrap(ptr)) {
+        return;
     }
-
-    if (old != NULL) {
-        rec = recordRemove(old - gGuardSize_B);
-        if (NULL == rec) {
-            fprintf(stderr,
-                    "FLLOC FATAL: Unknown pointer %p when doing reallocation\n",
-                    old);
-            abort();
-        }
-        checkForCorruption(rec);
-        if (rec->size < size) {
-            size = rec->size;
+    if (preloadBypass()) {
+        if (!gResolving) {
+            sysFree(ptr);
         }
-        memcpy(ptr, old, size);
-        free(rec->real);
-        free(rec);
+        return;
     }
-    return ptr;
+    tInside = 1;
+    FllocFree(ptr, NULL, 0);
+    tInside = 0;
 }
 
 
-static void fillGuard(Record* rec)
+int posix_memalign(void** memptr, size_t align, size_t size)
 {
-    if (gGuardSize_B > 0) {
-        memset(rec->real, FLLOC_FILL, gGuardSize_B);
-        memset(rec->real + gGuardSize_B + rec->size, FLLOC_FILL, gGuardSize_B);
+    if ((align < sizeof(void*)) || (align & (align - 1))) {
+        return EINVAL;
+    }
+    void* ptr = preloadAligned(align, size, __builtin_return_address(0));
+    if (NULL == ptr) {
+        return ENOMEM;
     }
+    *memptr = ptr;
+    return 0;
 }
 
 
-static void checkForCorruption(Record* rec)
+void* aligned_alloc(size_t align, size_t size)
 {
-    size_t i;
-    uint8_t* p = rec->real;
-    for (i = 0; i < gGuardSize_B; i++) {
-        if (*p != FLLOC_FILL) {
-            fprintf(gFile, "FLLOC: Corruption detected at %p, "
-                    "from block allocated at %s:%d\n",
-                    p, rec->file, rec->line);
-            gAllGood = 0;
-            return;
-        }
-        p++;
+    if ((0 == align) || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
     }
-    p = rec->real + gGuardSize_B + rec->size;
-    for (i = 0; i < gGuardSize_B; i++) {
-        if (*p != FLLOC_FILL) {
-            fprintf(gFile, "FLLOC: Corruption detected at %p, "
-                    "from block allocated at %s:%d\n",
-                    p, rec->file, rec->line);
-            gAllGood = 0;
-            return;
-        }
-        p++;
+    return preloadAligned(align, size, __builtin_return_address(0));
+}
+
+
+void* memalign(size_t align, size_t size)
+{
+    align = alignRoundUp(align);
+    if (0 == align) {
+        errno = EINVAL;
+        return NULL;
     }
+    return preloadAligned(align, size, __builtin_return_address(0));
 }
 
 
-static void fllocCheck(void)
+void* valloc(size_t size)
 {
-    pthread_mutex_lock(&gMutex);
-    int i;
-    for (i = 0; i < REC_COUNT; i++) {
-        Record* rec = gRecords[i].next;
-        while (rec != NULL) {
-            checkForCorruption(rec);
-            fprintf(gFile, "FLLOC: Memory leak detected: %p never freed; "
-                    "allocated from %s:%d\n",
-                    rec->real + gGuardSize_B, rec->file, rec->line);
-            rec = rec->next;
-            gAllGood = 0;
-        }
+    return preloadAligned(sysconf(_SC_PAGESIZE), size,
+            __builtin_return_address(0));
+}
+
+
+size_t malloc_usable_size(void* ptr)
+{
+    if (NULL == ptr) {
+        return 0;
     }
-    pthread_mutex_unlock(&gMutex);
-    if (gAllGood) {
-        fprintf(gFile, "FLLOC: No memory leak or corruption detected\n");
+    if (isBootstrap(ptr)) {
+        return ((size_t*)ptr)[-1];
+    }
+    if (preloadBypass()) {
+        return gResolving ? 0 : sysUsableSize(ptr);
     }
+    tInside = 1;
+    initIfNeeded();
+    size_t size;
+    if ((gSampleMean > 0) && isUntracked(ptr)) {
+        size = untrackedSize(ptr);
+    } else {
+        // NB: Only the requested size may be used; the rest is the guard
+        Record* rec = trackFind(ptr);
+        size = (NULL == rec) ? sysUsableSize(ptr) : rec->size;
+    }
+    tInside = 0;
+    return size;
 }
+
+#endif // FLLOC_PRELOAD
@@ -22,9 +22,13 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#ifdef __GLIBC__
+#include <malloc.h> // for memalign()
+#endif
 
 
 /** malloc-like function
@@ -97,6 +101,123 @@ char* FllocStrdup(const char* s, const char* file, int line);
 char* FllocStrndup(const char* s, size_t n, const char* file, int line);
 
 
+/** aligned_alloc-like function
+ *
+ * The front guard is rounded up so the returned pointer has the requested
+ * alignment; this wastes less than `align` bytes on top of the guard.
+ *
+ * @param align [in] Alignment; must be a power of 2
+ * @param size  [in] Size of the block
+ * @param file  [in] Source file; maybe be NULL
+ * @param line  [in] Line number
+ *
+ * @return As `aligned_alloc(3)`
+ */
+void* FllocAlignedAlloc(size_t align, size_t size, const char* file, int line);
+
+
+/** posix_memalign-like function
+ *
+ * @param memptr [out] Where to write the address of the block
+ * @param align  [in]  Alignment; must be a power of 2 and a multiple of
+ *                     `sizeof(void*)`
+ * @param size   [in]  Size of the block
+ * @param file   [in]  Source file; maybe be NULL
+ * @param line   [in]  Line number
+ *
+ * @return As `posix_memalign(3)`
+ */
+int FllocPosixMemalign(void** memptr, size_t align, size_t size,
+        const char* file, int line);
+
+
+/** memalign-like function
+ *
+ * @param align [in] Alignment; rounded up to a power of 2 if needed
+ * @param size  [in] Size of the block
+ * @param file  [in] Source file; maybe be NULL
+ * @param line  [in] Line number
+ *
+ * @return As `memalign(3)`
+ */
+void* FllocMemalign(size_t align, size_t size, const char* file, int line);
+
+
+/** How a block has been allocated, to detect mismatched deallocations */
+#define FLLOC_KIND_MALLOC    0 /**< `malloc()`, `calloc()`, `strdup()`... */
+#define FLLOC_KIND_NEW       1 /**< `operator new` */
+#define FLLOC_KIND_NEW_ARRAY 2 /**< `operator new[]` */
+
+
+/** Allocation function for the C++ `operator new` replacements
+ *
+ * @param size   [in] Number of bytes to allocate
+ * @param align  [in] Alignment, a power of 2; 0 for the default alignment
+ * @param kind   [in] `FLLOC_KIND_NEW` or `FLLOC_KIND_NEW_ARRAY`; C++ allocators
+ *                    use `FLLOC_KIND_MALLOC`
+ * @param file   [in] Source file; maybe be NULL
+ * @param line   [in] Line number
+ * @param caller [in] Return address of the operator; used to identify the
+ *                    allocation if `file` is NULL
+ *
+ * @return The allocated block, or NULL if out of memory
+ */
+void* FllocNew(size_t size, size_t align, int kind, const char* file,
+        int line, void* caller);
+
+
+/** Deallocation function for the C++ `operator delete` replacements
+ *
+ * @param ptr  [in] Block to free; may be NULL
+ * @param size [in] Size given to a sized `operator delete`, or 0 if unknown
+ * @param kind [in] `FLLOC_KIND_NEW` for `operator delete`,
+ *                  `FLLOC_KIND_NEW_ARRAY` for `operator delete[]`, or
+ *                  `FLLOC_KIND_MALLOC` for C++ allocators
+ * @param file [in] Source file; maybe be NULL
+ * @param line [in] Line number
+ */
+void FllocDelete(void* ptr, size_t size, int kind, const char* file, int line);
+
+
+/* Format of the files written with `TRACE`: a `FllocTraceHeader`, followed by
+ * `count` `FllocTraceEvent`s in native byte order. The events of each thread
+ * are in order, but the events of different threads are interleaved by
+ * batches; sort them by `time` if needed. Site ids refer to the lines of the
+ * `.sites` file written next to the trace.
+ */
+
+#define FLLOC_TRACE_MAGIC   "FLLOCTRC" /**< `magic` of `FllocTraceHeader` */
+#define FLLOC_TRACE_VERSION 1
+
+#define FLLOC_TRACE_MALLOC  1 /**< A block has been allocated */
+#define FLLOC_TRACE_FREE    2 /**< A block has been freed */
+#define FLLOC_TRACE_REALLOC 3 /**< A block has been allocated by `realloc()`;
+                                   the old block is freed by the event just
+                                   before */
+
+/** Header at the start of a trace file */
+typedef struct {
+    char     magic[8];  /**< `FLLOC_TRACE_MAGIC`, without null character */
+    uint32_t version;   /**< `FLLOC_TRACE_VERSION` */
+    uint32_t eventSize; /**< Size of each event, in bytes */
+    uint64_t count;     /**< Number of events in the file */
+    uint64_t dropped;   /**< Number of events lost because flloc could not
+                             write them fast enough */
+} FllocTraceHeader;
+
+/** An event in a trace file */
+typedef struct {
+    uint64_t time;     /**< Monotonic time, in ns */
+    uint64_t ptr;      /**< User pointer of the block */
+    uint64_t size;     /**< Size of the block */
+    uint32_t site;     /**< Site the block has been allocated from; 0 if not
+                            known */
+    uint16_t thread;   /**< Thread id, counting from 0 */
+    uint8_t  type;     /**< `FLLOC_TRACE_xxx` */
+    uint8_t  reserved;
+} FllocTraceEvent;
+
+
 /** Print a message in the log file */
 #define FllocPrintf(_format, ...) \
         FllocMsg(__FILE__, __LINE__, (_format), ## __VA_ARGS__)
@@ -149,6 +270,24 @@ void FllocVMsg(const char* file, int line, const char* format, va_list ap);
 #endif
 #define strndup(s, n) FllocStrndup((s), (n), __FILE__, __LINE__)
 
+#ifdef aligned_alloc
+#undef aligned_alloc
+#endif
+#define aligned_alloc(align, size) \
+        FllocAlignedAlloc((align), (size), __FILE__, __LINE__)
+
+#ifdef posix_memalign
+#undef posix_memalign
+#endif
+#define posix_memalign(memptr, align, size) \
+        FllocPosixMemalign((memptr), (align), (size), __FILE__, __LINE__)
+
+#ifdef memalign
+#undef memalign
+#endif
+#define memalign(align, size) \
+        FllocMemalign((align), (size), __FILE__, __LINE__)
+
 #endif /* !FLLOC_DISABLED */
 
 #ifdef __cplusplus
@@ -0,0 +1,215 @@
+/* Copyright (c) 2016  Fabrice Triboix
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* C++ allocators which allocate from flloc
+ *
+ * Each allocator has a tag, which is used as the allocation site of the
+ * blocks it allocates, so the blocks of a given container can be told apart
+ * in flloc reports and statistics:
+ *
+ *     std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+ *             FllocAllocator<std::pair<const int, int>>> map(
+ *             FllocAllocator<std::pair<const int, int>>("session map"));
+ *
+ * The tag must be a string which lives as long as the blocks; sites are told
+ * apart by the address of the string, not its content.
+ */
+
+#ifndef FLLOC_hpp_
+#define FLLOC_hpp_
+
+#include "flloc.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include <type_traits>
+#if (__cplusplus >= 201703L) && __has_include(<memory_resource>)
+#include <memory_resource>
+#define FLLOC_HAS_PMR 1
+#endif
+
+
+/** Alignment given to `FllocNew()` for the given alignment
+ *
+ * This is 0 (i.e. the default alignment of 16 bytes) for small alignments, so
+ * such blocks can be sampled.
+ */
+inline std::size_t FllocAlignment(std::size_t align)
+{
+    return (align > 16) ? align : 0;
+}
+
+
+/** Allocate memory for a C++ allocator; throw `std::bad_alloc` if failed */
+inline void* FllocAllocate(std::size_t size, std::size_t align,
+        const char* tag)
+{
+    void* ptr = FllocNew(size, FllocAlignment(align), FLLOC_KIND_MALLOC, tag,
+            0, NULL);
+    if (NULL == ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+
+/** Allocator compatible with the containers of the standard library */
+template <typename T>
+class FllocAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type is_always_equal;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    /** Constructor
+     *
+     * @param tag [in] Name of the allocation site for the allocated blocks
+     */
+    explicit FllocAllocator(const char* tag = "FllocAllocator") noexcept
+        : mTag(tag)
+    {
+    }
+
+    template <typename U>
+    FllocAllocator(const FllocAllocator<U>& other) noexcept
+        : mTag(other.tag())
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (n > (std::size_t(-1) / sizeof(T))) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(FllocAllocate(n * sizeof(T), alignof(T),
+                    mTag));
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept
+    {
+        FllocDelete(ptr, n * sizeof(T), FLLOC_KIND_MALLOC, mTag, 0);
+    }
+
+    const char* tag() const noexcept
+    {
+        return mTag;
+    }
+
+private:
+    const char* mTag;
+};
+
+
+/** All flloc allocators can free each other's blocks */
+template <typename T, typename U>
+bool operator==(const FllocAllocator<T>&, const FllocAllocator<U>&) noexcept
+{
+    return true;
+}
+
+
+template <typename T, typename U>
+bool operator!=(const FllocAllocator<T>&, const FllocAllocator<U>&) noexcept
+{
+    return false;
+}
+
+
+#ifdef FLLOC_HAS_PMR
+
+/** Memory resource for the polymorphic allocators of `std::pmr`
+ *
+ * The resource counts the blocks it currently has allocated, so the lifetime
+ * of the blocks can be checked against the lifetime of the resource: a warning
+ * is printed if it is destroyed while some of its blocks are still allocated,
+ * as these would be freed through a dangling resource.
+ */
+class FllocMemoryResource : public std::pmr::memory_resource
+{
+public:
+    /** Constructor
+     *
+     * @param tag [in] Name of the allocation site for the allocated blocks
+     */
+    explicit FllocMemoryResource(const char* tag = "FllocMemoryResource")
+        noexcept
+        : mTag(tag), mLiveCount(0), mLiveBytes(0)
+    {
+    }
+
+    ~FllocMemoryResource()
+    {
+        std::size_t count = liveCount();
+        if (count > 0) {
+            fprintf(stderr, "FLLOC WARNING: Memory resource '%s' destroyed "
+                    "with %zu block(s) still allocated (%zu bytes)\n", mTag,
+                    count, liveBytes());
+        }
+    }
+
+    const char* tag() const noexcept
+    {
+        return mTag;
+    }
+
+    /** Number of blocks currently allocated from this resource */
+    std::size_t liveCount() const noexcept
+    {
+        return mLiveCount.load(std::memory_order_relaxed);
+    }
+
+    /** Number of bytes currently allocated from this resource */
+    std::size_t liveBytes() const noexcept
+    {
+        return mLiveBytes.load(std::memory_order_relaxed);
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void* ptr = FllocAllocate(bytes, align, mTag);
+        mLiveCount.fetch_add(1, std::memory_order_relaxed);
+        mLiveBytes.fetch_add(bytes, std::memory_order_relaxed);
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t) override
+    {
+        FllocDelete(ptr, bytes, FLLOC_KIND_MALLOC, mTag, 0);
+        mLiveCount.fetch_sub(1, std::memory_order_relaxed);
+        mLiveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept
+        override
+    {
+        // NB: Any flloc resource can free the blocks of another one
+        return dynamic_cast<const FllocMemoryResource*>(&other) != NULL;
+    }
+
+private:
+    const char*              mTag;
+    std::atomic<std::size_t> mLiveCount;
+    std::atomic<std::size_t> mLiveBytes;
+};
+
+#endif // FLLOC_HAS_PMR
+
+#endif /* FLLOC_hpp_ */
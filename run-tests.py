@@ -2,6 +2,8 @@
 
 import sys
 import os
+import re
+import struct
 import subprocess
 
 if not os.path.exists("./unit-test"):
@@ -9,59 +11,280 @@ if not os.path.exists("./unit-test"):
     sys.exit(1)
 
 outputTest = "test.txt"
-os.environ['FLLOC_CONFIG'] = "FILE={};GUARD=128".format(outputTest)
-if os.path.exists(outputTest):
-    os.unlink(outputTest)
 expectedCorruptions = "expected-corruptions.txt"
-if os.path.exists(expectedCorruptions):
-    os.unlink(expectedCorruptions)
 expectedLeaks = "expected-leaks.txt"
-if os.path.exists(expectedLeaks):
-    os.unlink(expectedLeaks)
+expectedMismatches = "expected-mismatches.txt"
+expectedSameStack = "expected-same-stack.txt"
+traceFile = "trace.bin"
 
-subprocess.check_call(["./unit-test"])
+# Extra parameters to test; the unit test is run once for each entry
+configs = [
+    "",
+    "SHARDS=1",
+    "LOCKFREE=262144",
+    "CACHE=64",
+    "HEADER=1",
+    "CHECK=edge:8",
+    "MMAP=512",
+    "MMAP=512;HEADER=1",
+    "REPORT=grouped",
+    "SCAN=4",
+    "SCAN=4;REPORT=grouped;LOCKFREE=262144",
+    "STACK=8",
+    "STACK=8;HEADER=1;REPORT=grouped",
+    "SAMPLE=1;REPORT=grouped",
+    "SAMPLE=4096;REPORT=grouped",
+    "GUARD=13;ALIGN=64",
+    "GUARDSCAN=word",
+    "GUARDSCAN=word;GUARD=13;ALIGN=64",
+    "GUARDSCAN=sse2;GUARD=13;ALIGN=64",
+    "GUARDSCAN=avx2;GUARD=13;ALIGN=64",
+    "GUARD=32;CACHE=64;LOCKFREE=1048576",
+    "SCRUB=100000",
+    "PAGEGUARD=262144",
+    "PAGEGUARD=262144;PAGESIDE=underflow",
+    "CHECK=every:3",
+    "CHECK=random:0.5",
+    "STATS=1",
+    "STATS=1;GUARD=13;ALIGN=64",
+]
+
+# Extra parameters to test in preload mode, i.e. with 'unit-test-preload'
+# running with LD_PRELOAD=libflloc.so
+preloadConfigs = [
+    "",
+    "CACHE=64;STACK=8;REPORT=grouped",
+    "LOCKFREE=262144;SAMPLE=4096;REPORT=grouped",
+]
+
+# Extra parameters to test with an allocation trace, which is checked against
+# the leaks
+traceConfigs = [
+    "",
+    "SAMPLE=4096;CACHE=64",
+]
+
+# Extra parameters to test with 'unit-test-new', the C++ unit test
+newConfigs = [
+    "",
+    "CACHE=64;REPORT=grouped",
+    "STACK=8",
+]
+
+def runUnitTest(config, preload=False, program="./unit-test"):
+    os.environ['FLLOC_CONFIG'] = "FILE={};GUARD=128;{}".format(outputTest,
+            config)
+    if os.path.exists(outputTest):
+        os.unlink(outputTest)
+    if os.path.exists(expectedCorruptions):
+        os.unlink(expectedCorruptions)
+    if os.path.exists(expectedLeaks):
+        os.unlink(expectedLeaks)
+    if os.path.exists(expectedMismatches):
+        os.unlink(expectedMismatches)
+    if os.path.exists(expectedSameStack):
+        os.unlink(expectedSameStack)
+
+    if preload:
+        env = dict(os.environ)
+        env['LD_PRELOAD'] = os.path.abspath("libflloc.so")
+        subprocess.check_call(["./unit-test-preload"], env=env)
+        config = "preload;" + config
+    else:
+        subprocess.check_call([program])
+
+    if not os.path.exists(outputTest):
+        print("'unit-test' did not produce a '{}' file".format(outputTest))
+    if not os.path.exists(expectedCorruptions):
+        print("'unit-test' did not produce a '{}' file".format(expectedCorruptions))
+    if not os.path.exists(expectedLeaks):
+        print("'unit-text' did not produce a '{}' file".format(expectedLeaks))
+
+    f = open(outputTest)
+    corruptions = ""
+    leaks = ""
+    mismatches = ""
+    stats = ""
+    for line in f:
+        if (line.startswith("FLLOC: Site ")
+                or line.startswith("FLLOC: Alignment padding")):
+            stats += line
+        elif "corruption" in line.lower():
+            corruptions += line
+        elif "leak" in line.lower():
+            leaks += line
+        elif "mismatch" in line.lower():
+            mismatches += line
+        else:
+            print("Unknown line in flloc output: {}".format(line.strip()))
+            sys.exit(1)
+    f.close()
+
+    # Check memory corruption detection; when only some of the blocks being
+    # freed are checked, or only some blocks are tracked, only the guards of
+    # the large leaked block are sure to be
+    ok = True
+    sample = re.search(r"SAMPLE=(\d+)", config)
+    sampled = (sample is not None) and (int(sample.group(1)) > 1)
+    sampledCheck = ("CHECK=every:" in config) or ("CHECK=random:" in config)
+    if sampledCheck or sampled:
+        if not corruptions:
+            print("UNIT TEST FAIL ({}): flloc failed to detect memory "
+                    "corruption in leaked blocks".format(config))
+            ok = False
+    else:
+        f = open(expectedCorruptions)
+        for line in f:
+            line = line.strip().lower()
+            if not line in corruptions:
+                print("UNIT TEST FAIL ({}): flloc failed to detect memory "
+                        "corruption at {}".format(config, line))
+                ok = False
+        f.close()
 
-if not os.path.exists(outputTest):
-    print("'unit-test' did not produce a '{}' file".format(outputTest))
-if not os.path.exists(expectedCorruptions):
-    print("'unit-test' did not produce a '{}' file".format(expectedCorruptions))
-if not os.path.exists(expectedLeaks):
-    print("'unit-text' did not produce a '{}' file".format(expectedLeaks))
-
-f = open(outputTest)
-corruptions = ""
-leaks = ""
-for line in f:
-    if "corruption" in line.lower():
-        corruptions += line
-    elif "leak" in line.lower():
-        leaks += line
+    # Check memory leak detection; when sampling, only the sampled blocks are
+    # reported, but the estimated number of leaked blocks must be about right
+    f = open(expectedLeaks)
+    expected = [line.strip().lower() for line in f]
+    f.close()
+    if sampled:
+        reported = re.findall(r"detected: (0x[0-9a-f]+) never freed", leaks)
+        for samples in re.findall(r"e\.g\.((?: 0x[0-9a-f]+)+)", leaks):
+            reported += samples.split()
+        for ptr in reported:
+            # NB: In preload mode, the C library may leak blocks of its own
+            if (not preload) and (not ptr in expected):
+                print("UNIT TEST FAIL ({}): flloc reported a memory leak at {} "
+                        "which is not one".format(config, ptr))
+                ok = False
+        if "REPORT=grouped" in config:
+            estimated = sum(float(n) for n in
+                    re.findall(r"estimated (\d+) block", leaks))
+            if not ((len(expected) / 2) <= estimated <= (len(expected) * 2)):
+                print("UNIT TEST FAIL ({}): flloc estimated {} leaked blocks "
+                        "instead of about {}".format(config, estimated,
+                            len(expected)))
+                ok = False
     else:
-        print("Unknown line in flloc output: {}".format(line.strip()))
-        sys.exit(1)
-f.close()
+        for line in expected:
+            if not line in leaks:
+                print("UNIT TEST FAIL ({}): flloc failed to detect memory "
+                        "leak at {}".format(config, line))
+                ok = False
+
+    # Check each leak comes with its call stack, which starts at the caller of
+    # the allocation function when that is what the leak is attributed to
+    if "STACK=" in config:
+        for line in leaks.splitlines():
+            stack = re.search(r"; stack:((?: 0x[0-9a-f]+)+)", line)
+            if stack is None:
+                print("UNIT TEST FAIL ({}): flloc did not print the call "
+                        "stack of leak: {}".format(config, line))
+                ok = False
+                continue
+            site = re.search(r"allocated from (0x[0-9a-f]+)", line)
+            if (site is not None) and (stack.group(1).split()[0] != site.group(1)):
+                print("UNIT TEST FAIL ({}): call stack does not start at the "
+                        "caller: {}".format(config, line))
+                ok = False
+
+    # Check blocks allocated from the same call stack are reported with the
+    # same stack, and together in grouped reports
+    if os.path.exists(expectedSameStack):
+        f = open(expectedSameStack)
+        ptrs = [line.strip().lower() for line in f]
+        f.close()
+        lines = [line for line in leaks.splitlines()
+                if all(ptr in line for ptr in ptrs)]
+        stacks = set(re.sub(r".*; stack:", "", line)
+                for line in leaks.splitlines() if any(ptr in line for ptr in ptrs))
+        if len(stacks) != 1:
+            print("UNIT TEST FAIL ({}): blocks allocated from the same call "
+                    "stack have different stacks".format(config))
+            ok = False
+        if ("REPORT=grouped" in config) and (len(lines) != 1
+                or not lines[0].startswith("FLLOC: Memory leak detected: "
+                    "{} block(s)".format(len(ptrs)))):
+            print("UNIT TEST FAIL ({}): blocks allocated from the same call "
+                    "stack are not reported together".format(config))
+            ok = False
+
+    # Check the statistics account for the leaked blocks
+    if "STATS=1" in config:
+        f = open(expectedLeaks)
+        count = len(f.readlines())
+        f.close()
+        live = sum(int(n) for n in re.findall(r"(\d+) still allocated", stats))
+        if live != count:
+            print("UNIT TEST FAIL ({}): statistics count {} blocks still "
+                    "allocated instead of {}".format(config, live, count))
+            ok = False
+
+    # Check mismatched deallocation detection, if the test does any
+    if os.path.exists(expectedMismatches):
+        f = open(expectedMismatches)
+        for line in f:
+            line = line.strip().lower()
+            if not line in mismatches:
+                print("UNIT TEST FAIL ({}): flloc failed to detect mismatched "
+                        "deallocation of {}".format(config, line))
+                ok = False
+        f.close()
+    return ok
+
+def checkTrace(config):
+    config = "TRACE={};{}".format(traceFile, config)
+    if not runUnitTest(config):
+        return False
+    f = open(traceFile, "rb")
+    data = f.read()
+    f.close()
+    header = struct.unpack_from("=8sIIQQ", data, 0)
+    magic, version, eventSize, count, dropped = header
+    if (magic != b"FLLOCTRC") or ((len(data) - 32) != (count * eventSize)):
+        print("UNIT TEST FAIL ({}): invalid trace file".format(config))
+        return False
+    if dropped > 0:
+        # The events can't be matched if some are missing
+        return True
+
+    # Replay the trace in time order; the blocks left should be the leaked ones
+    events = [struct.unpack_from("=QQQIHBB", data, 32 + (i * eventSize))
+            for i in range(count)]
+    events.sort(key=lambda event: event[0])
+    live = set()
+    for event in events:
+        ptr = event[1]
+        if event[5] != 2:
+            live.add(ptr)
+        elif ptr in live:
+            live.remove(ptr)
+        else:
+            print("UNIT TEST FAIL ({}): trace frees unknown block "
+                    "{:#x}".format(config, ptr))
+            return False
+    f = open(expectedLeaks)
+    leaks = set(int(line, 16) for line in f)
+    f.close()
+    if live != leaks:
+        print("UNIT TEST FAIL ({}): trace does not match the leaked "
+                "blocks".format(config))
+        return False
+    return True
 
-# Check memory corruption detection
 ok = True
-f = open(expectedCorruptions)
-for line in f:
-    line = line.strip().lower()
-    if not line in corruptions:
-        print("UNIT TEST FAIL: flloc failed to detect memory corruption at {}"
-                .format(line))
+for config in configs:
+    if not runUnitTest(config):
         ok = False
-f.close()
-
-# Check memory leak detection
-f = open(expectedLeaks)
-for line in f :
-    line = line.strip().lower()
-    if not line in leaks:
-        print("UNIT TEST FAIL: flloc failed to detect memory leak at {}"
-                .format(line))
+for config in preloadConfigs:
+    if not runUnitTest(config, preload=True):
+        ok = False
+for config in newConfigs:
+    if not runUnitTest(config, program="./unit-test-new"):
+        ok = False
+for config in traceConfigs:
+    if not checkTrace(config):
         ok = False
-f.close()
-
 if not ok:
     sys.exit(1)
 
@@ -69,6 +292,7 @@ if not ok:
 os.environ['MALLOC_TRACE'] = "mtrace.txt"
 subprocess.check_call(["./unit-test"])
 mtrace = subprocess.check_output(["./run-mtrace.sh", "unit-test", "mtrace.txt"])
+mtrace = mtrace.decode("utf-8", "replace")
 if "flloc.c" in mtrace:
     print("UNIT TEST FAIL: Memory leaks detected inside flloc itself!")
     print("Run `mtrace unit-test mtrace.txt` for more information.")
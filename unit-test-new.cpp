@@ -0,0 +1,141 @@
+/* Copyright (c) 2016  Fabrice Triboix
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+#include "flloc.hpp"
+
+// Mismatched deallocations are done on purpose below
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+struct alignas(64) Aligned {
+    char data[100];
+};
+
+struct WithDestructor {
+    ~WithDestructor() { gDestroyed++; }
+    static int gDestroyed;
+    int x;
+};
+int WithDestructor::gDestroyed = 0;
+
+static FILE* openExpected(const char* filename)
+{
+    FILE* f = fopen(filename, "w");
+    if (NULL == f) {
+        fprintf(stderr, "Failed to create file '%s'\n", filename);
+        exit(1);
+    }
+    return f;
+}
+
+int main()
+{
+    // All forms of new and delete, used properly
+    int* i = new int(42);
+    delete i;
+    WithDestructor* array = new WithDestructor[10];
+    delete[] array;
+    if (WithDestructor::gDestroyed != 10) {
+        fprintf(stderr, "delete[] did not call the destructors\n");
+        exit(1);
+    }
+    Aligned* aligned = new Aligned;
+    Aligned* alignedArray = new Aligned[3];
+    if ((((uintptr_t)aligned) % 64) || (((uintptr_t)alignedArray) % 64)) {
+        fprintf(stderr, "new did not align the block\n");
+        exit(1);
+    }
+    delete aligned;
+    delete[] alignedArray;
+    char* nothrow = new (std::nothrow) char[10];
+    delete[] nothrow;
+
+    // Containers using flloc allocators
+    {
+        typedef std::pair<const int, int> Pair;
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+            FllocAllocator<Pair> > map(16, std::hash<int>(),
+                    std::equal_to<int>(), FllocAllocator<Pair>("map"));
+        for (int k = 0; k < 1000; k++) {
+            map[k] = k;
+        }
+        std::vector<Aligned, FllocAllocator<Aligned> > vector(10);
+        if (((uintptr_t)vector.data()) % 64) {
+            fprintf(stderr, "FllocAllocator did not align the block\n");
+            exit(1);
+        }
+#ifdef FLLOC_HAS_PMR
+        FllocMemoryResource resource("pmr");
+        std::pmr::vector<int> pmrVector(&resource);
+        for (int k = 0; k < 1000; k++) {
+            pmrVector.push_back(k);
+        }
+        if ((resource.liveCount() != 1)
+                || (resource.liveBytes() != pmrVector.capacity() * sizeof(int))) {
+            fprintf(stderr, "FllocMemoryResource miscounted its blocks\n");
+            exit(1);
+        }
+        pmrVector.clear();
+        pmrVector.shrink_to_fit();
+        if ((resource.liveCount() != 0) || (resource.liveBytes() != 0)) {
+            fprintf(stderr, "FllocMemoryResource miscounted its blocks\n");
+            exit(1);
+        }
+#endif
+    }
+
+    // Corrupt a block
+    FILE* f = openExpected("expected-corruptions.txt");
+    volatile int size = 16; // hide the overflow from gcc
+    char* corrupted = new char[size];
+    corrupted[size] = 0;
+    fprintf(f, "%p\n", &(corrupted[size]));
+    delete[] corrupted;
+    fclose(f);
+
+    // Leak a block
+    f = openExpected("expected-leaks.txt");
+    long* leaked = new long[3];
+    fprintf(f, "%p\n", leaked);
+    FllocAllocator<int> allocator("test allocator");
+    int* leakedInts = allocator.allocate(5);
+    fprintf(f, "%p\n", leakedInts);
+    fclose(f);
+
+    // Free blocks with the wrong function or the wrong size
+    f = openExpected("expected-mismatches.txt");
+    void* ptr = ::operator new[](32);
+    fprintf(f, "%p\n", ptr);
+    ::operator delete(ptr);
+    ptr = ::operator new(32);
+    fprintf(f, "%p\n", ptr);
+    free(ptr);
+    ptr = malloc(32);
+    fprintf(f, "%p\n", ptr);
+    ::operator delete(ptr);
+    ptr = ::operator new(32);
+    fprintf(f, "%p\n", ptr);
+    ::operator delete(ptr, 48);
+    int* ints = allocator.allocate(5);
+    fprintf(f, "%p\n", ints);
+    allocator.deallocate(ints, 3);
+    fclose(f);
+    return 0;
+}
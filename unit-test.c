@@ -17,12 +17,55 @@
 #include "flloc.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <mcheck.h>
 
 #define COUNT 100000
 static unsigned char* gPointers[COUNT];
 static int gSizes[COUNT];
 
+#define SMALL_COUNT 4000
+
+#define HANDOFF_THREADS 8
+#define HANDOFF_SLOTS 64
+#define HANDOFF_ITERATIONS 20000
+
+/** Blocks allocated by one thread, waiting to be freed by another one */
+static void* _Atomic gHandoff[HANDOFF_SLOTS];
+
+/** Allocate blocks and free the ones other threads allocated */
+static void* handoffThread(void* arg)
+{
+    uint32_t seed = (uint32_t)(uintptr_t)arg;
+    int i;
+    for (i = 0; i < HANDOFF_ITERATIONS; i++) {
+        seed = (seed * 1103515245) + 12345;
+        void* ptr = malloc(16 + ((seed >> 16) % 64));
+        if (NULL == ptr) {
+            abort();
+        }
+        ptr = atomic_exchange(&gHandoff[(seed >> 8) % HANDOFF_SLOTS], ptr);
+        free(ptr);
+    }
+    return NULL;
+}
+
+/** Allocate a block, always from the same call stack for a given caller */
+static __attribute__ (( noinline )) void* allocSameStack(void)
+{
+    void* ptr = malloc(24);
+    __asm__ volatile ("" : : : "memory"); // not a tail call
+    return ptr;
+}
+
 int main()
 {
     mtrace();
@@ -31,6 +74,11 @@ int main()
     for (i = 0; i < COUNT; i++) {
         gSizes[i] = 10 + (2 * i);
         gPointers[i] = malloc(gSizes[i]);
+        if ((uintptr_t)gPointers[i] % _Alignof(max_align_t)) {
+            fprintf(stderr, "malloc() returned a misaligned block %p\n",
+                    gPointers[i]);
+            exit(1);
+        }
     }
 
     // Corrupt a couple of memory blocks
@@ -73,6 +121,275 @@ int main()
     ptr = realloc(ptr, 90);
     free(ptr);
 
+    // Grow and shrink a block, checking its content is preserved
+    unsigned char* buf = NULL;
+    for (i = 1; i <= 1000; i++) {
+        buf = realloc(buf, i);
+        if (NULL == buf) {
+            abort();
+        }
+        buf[i - 1] = i & 0xff;
+    }
+    for (i = 1000; i > 0; i -= 7) {
+        buf = realloc(buf, i);
+        int j;
+        for (j = 0; j < i; j++) {
+            if (buf[j] != ((j + 1) & 0xff)) {
+                fprintf(stderr, "realloc() corrupted block content\n");
+                exit(1);
+            }
+        }
+    }
+    free(buf);
+
+#ifdef FLLOC_DISABLED
+    // In preload mode, only the requested size of a block may be used. The
+    // size is asked twice on purpose: asking must not untrack the block, else
+    // the second call would not find it.
+    buf = malloc(100);
+    if ((NULL == buf) || (malloc_usable_size(buf) != 100)
+            || (malloc_usable_size(buf) != 100)) {
+        fprintf(stderr, "malloc_usable_size() returned a wrong size\n");
+        exit(1);
+    }
+    free(buf);
+#endif
+
+    // Test calloc function
+    int* array = calloc(1000, sizeof(*array));
+    if (NULL == array) {
+        abort();
+    }
+    for (i = 0; i < 1000; i++) {
+        if (array[i] != 0) {
+            fprintf(stderr, "calloc() did not zero the block\n");
+            exit(1);
+        }
+    }
+    free(array);
+    volatile size_t huge = (size_t)-1 / 2; // hide the overflow from gcc
+    if (calloc(huge, 4) != NULL) {
+        fprintf(stderr, "calloc() did not detect an overflow\n");
+        exit(1);
+    }
+
+    // Sizes which overflow once the guards are added
+    volatile size_t almostMax = SIZE_MAX - 10;
+    errno = 0;
+    if ((calloc(1, almostMax) != NULL) || (errno != ENOMEM)) {
+        fprintf(stderr, "calloc() did not detect an overflow\n");
+        exit(1);
+    }
+    if ((malloc(almostMax) != NULL)
+            || (aligned_alloc(64, almostMax) != NULL)) {
+        fprintf(stderr, "malloc() did not detect an overflow\n");
+        exit(1);
+    }
+    buf = malloc(10);
+    if ((NULL == buf) || (realloc(buf, almostMax) != NULL)) {
+        fprintf(stderr, "realloc() did not detect an overflow\n");
+        exit(1);
+    }
+    free(buf);
+
+    // Test aligned allocations, filling them to check nothing is corrupted
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    void* aligned[4];
+    aligned[0] = aligned_alloc(64, 100);
+    aligned[1] = memalign(48, 100); // rounded up to 64
+    aligned[2] = NULL;
+    if (posix_memalign(&aligned[2], pageSize, 5000) != 0) {
+        aligned[2] = NULL;
+    }
+    aligned[3] = aligned_alloc(pageSize * 4, 10);
+    size_t alignments[4] = { 64, 64, pageSize, pageSize * 4 };
+    volatile size_t sizes[4] = { 100, 100, 5000, 10 }; // hide the overrun
+    for (i = 0; i < 4; i++) {
+        if ((NULL == aligned[i]) || ((uintptr_t)aligned[i] % alignments[i])) {
+            fprintf(stderr, "Bad aligned block %p (alignment %zu)\n",
+                    aligned[i], alignments[i]);
+            exit(1);
+        }
+        memset(aligned[i], 0, sizes[i]);
+    }
+    f = fopen("expected-corruptions.txt", "a");
+    if (NULL == f) {
+        fprintf(stderr, "Failed to append to 'expected-corruptions.txt'\n");
+        exit(1);
+    }
+    unsigned char* overrun = (unsigned char*)aligned[1] + sizes[1];
+    *overrun = 0;
+    fprintf(f, "%p\n", overrun);
+    fclose(f);
+    for (i = 0; i < 4; i++) {
+        free(aligned[i]);
+    }
+    void* dummy;
+    if (posix_memalign(&dummy, 3, 10) != EINVAL) {
+        fprintf(stderr, "posix_memalign() accepted a bad alignment\n");
+        exit(1);
+    }
+    volatile size_t hugeAlign = (SIZE_MAX / 2) + 2;
+    if (memalign(hugeAlign, 10) != NULL) {
+        fprintf(stderr, "memalign() accepted a bad alignment\n");
+        exit(1);
+    }
+
+    // Resize small blocks, which are mostly not sampled if `SAMPLE` is set, so
+    // they move between untracked and tracked blocks
+    unsigned char* small[SMALL_COUNT];
+    for (i = 0; i < SMALL_COUNT; i++) {
+        small[i] = malloc(32);
+        if (NULL == small[i]) {
+            abort();
+        }
+        memset(small[i], i & 0xff, 32);
+    }
+    size_t smallSizes[3] = { 64, 2000, 16 };
+    int k;
+    for (k = 0; k < 3; k++) {
+        for (i = 0; i < SMALL_COUNT; i++) {
+            small[i] = realloc(small[i], smallSizes[k]);
+            if (NULL == small[i]) {
+                abort();
+            }
+            int j;
+            for (j = 0; j < 16; j++) {
+                if (small[i][j] != (i & 0xff)) {
+                    fprintf(stderr, "realloc() corrupted small block "
+                            "content\n");
+                    exit(1);
+                }
+            }
+        }
+    }
+    for (i = 0; i < SMALL_COUNT; i++) {
+        free(small[i]);
+    }
+
+    // When sampling, leak many small blocks: only a few of them are tracked,
+    // and the report must estimate how many there are
+    const char* config = getenv("FLLOC_CONFIG");
+    const char* sample = (config != NULL) ? strstr(config, "SAMPLE=") : NULL;
+    if (!noleak && (sample != NULL)
+            && (atol(sample + strlen("SAMPLE=")) > 1)) {
+        f = fopen("expected-leaks.txt", "a");
+        if (NULL == f) {
+            fprintf(stderr, "Failed to append to 'expected-leaks.txt'\n");
+            exit(1);
+        }
+        for (i = 0; i < SMALL_COUNT; i++) {
+            fprintf(f, "%p\n", malloc(64));
+        }
+        fclose(f);
+    }
+
+    // Leak two blocks allocated from the same call stack, which must be
+    // recorded only once
+    if (!noleak && (config != NULL) && (strstr(config, "STACK=") != NULL)) {
+        FILE* leaksFile = fopen("expected-leaks.txt", "a");
+        f = fopen("expected-same-stack.txt", "w");
+        if ((NULL == leaksFile) || (NULL == f)) {
+            fprintf(stderr, "Failed to write the expected leaks\n");
+            exit(1);
+        }
+        volatile int count = 2; // keep it a loop with a single call
+        for (i = 0; i < count; i++) {
+            void* ptr = allocSameStack();
+            fprintf(leaksFile, "%p\n", ptr);
+            fprintf(f, "%p\n", ptr);
+        }
+        fclose(leaksFile);
+        fclose(f);
+    }
+
+    // Corrupt the front guard of a block out of reach of the check done when
+    // freeing it, so only the scrubbing thread can report it
+    if ((config != NULL) && (strstr(config, "SCRUB=") != NULL)) {
+        buf = malloc(100);
+        if (NULL == buf) {
+            abort();
+        }
+        volatile int before = -64; // hide the underrun from gcc
+        buf[before] = 0xff;
+        f = fopen("expected-corruptions.txt", "a");
+        if (NULL == f) {
+            fprintf(stderr, "Failed to append to 'expected-corruptions.txt'\n");
+            exit(1);
+        }
+        fprintf(f, "%p\n", &(buf[before]));
+        fclose(f);
+        sleep(1);
+        free(buf);
+    }
+
+    // Large blocks are page guarded if `PAGEGUARD` is set: resizing them must
+    // keep their content, and going past them must crash
+    if ((config != NULL) && (strstr(config, "PAGEGUARD=") != NULL)) {
+        size_t large = 1024 * 1024;
+        buf = malloc(large);
+        if (NULL == buf) {
+            abort();
+        }
+        size_t j;
+        for (j = 0; j < large; j++) {
+            buf[j] = j & 0xff;
+        }
+        size_t resized[2] = { 2 * large, large / 2 };
+        for (i = 0; i < 2; i++) {
+            buf = realloc(buf, resized[i]);
+            if (NULL == buf) {
+                abort();
+            }
+            for (j = 0; j < large / 2; j++) {
+                if (buf[j] != (j & 0xff)) {
+                    fprintf(stderr, "realloc() corrupted page guarded "
+                            "block content\n");
+                    exit(1);
+                }
+            }
+        }
+        int underflow = (strstr(config, "PAGESIDE=underflow") != NULL);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Failed to fork\n");
+            exit(1);
+        }
+        if (0 == pid) {
+            volatile size_t end = large / 2; // hide the overrun from gcc
+            if (underflow) {
+                buf[-1] = 0;
+            } else {
+                buf[end] = 0;
+            }
+            _exit(0);
+        }
+        int status;
+        if ((waitpid(pid, &status, 0) != pid) || !WIFSIGNALED(status)
+                || (WTERMSIG(status) != SIGSEGV)) {
+            fprintf(stderr, "Going past a page guarded block did not "
+                    "crash\n");
+            exit(1);
+        }
+        free(buf);
+    }
+
+    // Free blocks from other threads than the ones which allocated them
+    pthread_t threads[HANDOFF_THREADS];
+    for (i = 0; i < HANDOFF_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, handoffThread,
+                    (void*)(uintptr_t)(i + 1)) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < HANDOFF_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < HANDOFF_SLOTS; i++) {
+        free(gHandoff[i]);
+    }
+
     muntrace();
     return 0;
 }